@@ -30,6 +30,15 @@ typedef unsigned long uint32_t;
 #ifndef uint64_t
 typedef long long unsigned int uint64_t;
 #endif
+#ifndef int16_t
+typedef short int16_t;
+#endif
+#ifndef int32_t
+typedef long int32_t;
+#endif
+#ifndef int64_t
+typedef long long int int64_t;
+#endif
 #ifndef bool_t
 typedef int bool_t;
 #endif
@@ -73,6 +82,16 @@ inline static void bram_set(uint8_t bram_select, uint16_t base_bram_addr, uint16
   while (cnt-- > 0) *dst++ = value;
 }
 
+inline static void bram_set_stride(uint8_t bram_select, uint16_t base_bram_addr, uint16_t value, uint32_t cnt, uint32_t stride) {
+  uint16_t base_addr = get_addr(bram_select, base_bram_addr);
+  volatile uint16_t *base = (volatile uint16_t *)FPGA_BASE;
+  volatile uint16_t *dst = &base[base_addr];
+  while (cnt-- > 0) {
+    *dst = value;
+    dst += stride;
+  }
+}
+
 inline static void memcpy_volatile(volatile void *restrict dst, const volatile void *restrict src, uint32_t cnt) {
   const volatile unsigned char *src_c = src;
   volatile unsigned char *dst_c = dst;
@@ -98,6 +117,19 @@ typedef struct {
 typedef struct {
   uint16_t reserved;
   uint16_t ack;
+  uint8_t recv_msg_id;    /* highest contiguous msg_id received */
+  uint8_t applied_msg_id; /* highest msg_id up to which every frame has been written to BRAM */
+  uint8_t stamp_msg_id;   /* msg_id of the last frame written to BRAM, to which the two times below refer */
+  uint8_t _pad;
+  uint32_t recv_time;   /* DC time (lower 32 bits, ns) at which recv_ethercat accepted stamp_msg_id */
+  uint32_t commit_time; /* DC time (lower 32 bits, ns) at which stamp_msg_id was written to BRAM */
+  uint8_t queue_depth;   /* frames waiting in the ring */
+  uint8_t pending_num;   /* timed frames waiting for their activation time */
+  uint16_t err;          /* sticky error flags, cleared by MSG_CLEAR */
+  uint32_t stm_cycle;    /* STM patterns written since STM_BEGIN */
+  uint32_t mod_cycle;    /* Modulation data written since MOD_BEGIN */
+  uint16_t telemetry_id; /* kind of telemetry, rotated every update() */
+  uint16_t telemetry;
 } TX_STR;
 
 #endif /* APP_H_ */
@@ -0,0 +1,113 @@
+// File: fixed_math.h
+// Project: inc
+// Created Date: 16/10/2026
+// Author: agent
+// -----
+// Last Modified: 16/10/2026
+// Modified By: agent
+// -----
+// Copyright (c) 2022 Shun Suzuki. All rights reserved.
+//
+
+#ifndef INC_FIXED_MATH_H_
+#define INC_FIXED_MATH_H_
+
+// Fixed-point kernels for on-device gain computation.
+// Table values are scaled by FX_TURN (= 2^16), and converted to 13-bit phase/duty words with the cycle table.
+// Error bounds below are against double precision references, for cycles up to 8191.
+// No sin/cos or atan2 kernels are provided, since nothing on the device needs them.
+
+#define FX_TURN_WIDTH (16)
+#define FX_TURN (1 << FX_TURN_WIDTH)
+
+static const uint16_t FX_SQRT_SEED[192] = {
+    32896, 33150, 33402, 33652, 33900, 34147, 34392, 34635, 34876, 35116, 35354, 35590, 35825, 36059, 36291, 36521,
+    36750, 36978, 37204, 37429, 37652, 37874, 38095, 38315, 38533, 38750, 38966, 39181, 39394, 39606, 39818, 40028,
+    40237, 40445, 40652, 40857, 41062, 41266, 41469, 41671, 41871, 42071, 42270, 42468, 42665, 42861, 43057, 43251,
+    43445, 43637, 43829, 44020, 44210, 44400, 44588, 44776, 44963, 45149, 45334, 45519, 45703, 45886, 46069, 46250,
+    46431, 46612, 46791, 46970, 47149, 47326, 47503, 47679, 47855, 48030, 48204, 48378, 48551, 48723, 48895, 49067,
+    49237, 49407, 49577, 49746, 49914, 50082, 50249, 50416, 50582, 50747, 50912, 51077, 51241, 51404, 51567, 51730,
+    51892, 52053, 52214, 52374, 52534, 52694, 52853, 53011, 53169, 53327, 53484, 53640, 53797, 53952, 54108, 54262,
+    54417, 54571, 54724, 54877, 55030, 55182, 55334, 55485, 55636, 55787, 55937, 56087, 56236, 56385, 56534, 56682,
+    56830, 56977, 57124, 57271, 57417, 57563, 57709, 57854, 57999, 58143, 58287, 58431, 58574, 58717, 58860, 59002,
+    59144, 59286, 59427, 59568, 59709, 59849, 59989, 60129, 60268, 60407, 60546, 60684, 60822, 60960, 61098, 61235,
+    61372, 61508, 61644, 61780, 61916, 62051, 62186, 62321, 62456, 62590, 62724, 62857, 62991, 63124, 63256, 63389,
+    63521, 63653, 63785, 63916, 64047, 64178, 64309, 64439, 64569, 64699, 64828, 64957, 65086, 65215, 65344, 65472
+};
+
+static const uint16_t FX_ASIN[256] = {
+    0, 82, 164, 245, 327, 409, 491, 573, 655, 736, 818, 900, 982, 1064, 1146, 1228,
+    1310, 1392, 1474, 1556, 1638, 1720, 1802, 1884, 1966, 2048, 2131, 2213, 2295, 2378, 2460, 2542,
+    2625, 2707, 2790, 2872, 2955, 3038, 3120, 3203, 3286, 3369, 3452, 3535, 3618, 3701, 3784, 3867,
+    3950, 4034, 4117, 4200, 4284, 4368, 4451, 4535, 4619, 4703, 4787, 4871, 4955, 5039, 5123, 5208,
+    5292, 5377, 5461, 5546, 5631, 5716, 5801, 5886, 5971, 6057, 6142, 6228, 6313, 6399, 6485, 6571,
+    6657, 6743, 6830, 6916, 7003, 7089, 7176, 7263, 7350, 7437, 7525, 7612, 7700, 7788, 7876, 7964,
+    8052, 8140, 8229, 8318, 8406, 8495, 8585, 8674, 8763, 8853, 8943, 9033, 9123, 9214, 9304, 9395,
+    9486, 9577, 9668, 9760, 9852, 9944, 10036, 10128, 10221, 10314, 10407, 10500, 10594, 10687, 10781, 10875,
+    10970, 11065, 11160, 11255, 11350, 11446, 11542, 11638, 11735, 11832, 11929, 12026, 12124, 12222, 12320, 12419,
+    12518, 12617, 12717, 12817, 12917, 13018, 13119, 13220, 13322, 13424, 13526, 13629, 13732, 13836, 13940, 14044,
+    14149, 14255, 14360, 14466, 14573, 14680, 14788, 14896, 15004, 15113, 15223, 15333, 15443, 15554, 15666, 15778,
+    15891, 16004, 16118, 16233, 16348, 16464, 16580, 16697, 16815, 16934, 17053, 17173, 17294, 17415, 17537, 17660,
+    17784, 17909, 18035, 18161, 18288, 18417, 18546, 18676, 18808, 18940, 19074, 19208, 19344, 19481, 19619, 19759,
+    19899, 20041, 20185, 20330, 20476, 20624, 20774, 20925, 21078, 21233, 21390, 21549, 21709, 21872, 22037, 22205,
+    22375, 22547, 22722, 22900, 23082, 23266, 23454, 23645, 23840, 24039, 24243, 24451, 24664, 24883, 25108, 25339,
+    25577, 25823, 26078, 26343, 26618, 26907, 27209, 27529, 27869, 28234, 28630, 29068, 29565, 30154, 30920, 32768
+};
+
+inline static uint32_t fx_clz32(uint32_t v) {
+  uint32_t n = 0;
+  if (v == 0) return 32;
+  if ((v & 0xFFFF0000) == 0) {
+    n += 16;
+    v <<= 16;
+  }
+  if ((v & 0xFF000000) == 0) {
+    n += 8;
+    v <<= 8;
+  }
+  if ((v & 0xF0000000) == 0) {
+    n += 4;
+    v <<= 4;
+  }
+  if ((v & 0xC0000000) == 0) {
+    n += 2;
+    v <<= 2;
+  }
+  if ((v & 0x80000000) == 0) n += 1;
+  return n;
+}
+
+// floor(sqrt(v)), exact
+// one table lookup, one division and one Newton step
+inline static uint32_t fx_isqrt32(uint32_t v) {
+  uint32_t shift, u, x;
+  if (v == 0) return 0;
+  shift = fx_clz32(v) & ~1u;
+  u = v << shift;
+  x = FX_SQRT_SEED[(u >> 24) - 64];
+  x = (x + u / x) >> 1;
+  if (x > 0xFFFF) x = 0xFFFF;
+  if (x * x > u) x--;
+  return x >> (shift >> 1);
+}
+
+// floor(sqrt(v)) for v < 2^32, otherwise relative error <= 2^-15
+inline static uint32_t fx_isqrt64(uint64_t v) {
+  uint32_t hi = (uint32_t)(v >> 32);
+  uint32_t shift;
+  if (hi == 0) return fx_isqrt32((uint32_t)v);
+  shift = (32 - fx_clz32(hi) + 1) & ~1u;
+  return fx_isqrt32((uint32_t)(v >> shift)) << (shift >> 1);
+}
+
+// normalized amplitude (255 = 1) to duty word, duty = cycle * asin(amp) / pi, |error| < 0.561 (0.5605 at amp = 159, cycle = 8178)
+inline static uint32_t fx_amp_to_duty(uint8_t amp, uint32_t cycle) { return (cycle * FX_ASIN[amp] + (FX_TURN >> 1)) >> FX_TURN_WIDTH; }
+
+// distance to phase word, phase = dist * wavenum mod cycle
+// frac_width is the total number of fractional bits of dist and wavenum
+inline static uint32_t fx_dist_to_phase(uint32_t dist, uint32_t wavenum, uint32_t frac_width, uint32_t cycle) {
+  if (cycle == 0) return 0;
+  return (uint32_t)(((uint64_t)dist * wavenum) >> frac_width) % cycle;
+}
+
+#endif  // INC_FIXED_MATH_H_
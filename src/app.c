@@ -13,11 +13,12 @@
 
 #include "app.h"
 
+#include "fixed_math.h"
 #include "iodefine.h"
 #include "params.h"
 #include "utils.h"
 
-#define CPU_VERSION (0x82) /* v2.2 */
+#define CPU_VERSION (0x83) /* v2.3 */
 
 #define MOD_BUF_SEGMENT_SIZE_WIDTH (15)
 #define MOD_BUF_SEGMENT_SIZE (1 << MOD_BUF_SEGMENT_SIZE_WIDTH)
@@ -34,6 +35,70 @@
 #define GAIN_DATA_MODE_PHASE_DUTY_FULL (0x0001)
 #define GAIN_DATA_MODE_PHASE_FULL (0x0002)
 #define GAIN_DATA_MODE_PHASE_HALF (0x0004)
+#define GAIN_DATA_MODE_PHASE_COMPACT (0x0008)
+#define GAIN_DATA_MODE_PACKED (0x0010)
+
+#define POINT_STM_FIXED_NUM_WIDTH (18)
+
+#define POSE_ROT_FRAC_WIDTH (14)
+
+#define TRANS_NUM_X (18)
+#define TRANS_NUM_Y (14)
+#define TRANS_SPACING_NUM (2032) /* 10.16mm = 2032/5 Point STM unit */
+#define TRANS_SPACING_DEN (5)
+#define TRANS_POS_FRAC_WIDTH (4)
+#define FOCUS_WAVENUM_FRAC_WIDTH (16)
+
+#define EXT_MARKER (0x80) /* set in size of non-MOD frames to carry an extended operation; modulation sizes never reach it */
+#define EXT_OP_MASK (0x7F)
+
+#define EXT_FLAG_TIMED (1 << 0)              /* hold the frame until EXT.time */
+#define EXT_FLAG_SYNC_KEEP_CYCLE (1 << 1)    /* CONFIG_SYNC: header only, reuse the current cycles */
+#define EXT_FLAG_SYNC_UNIFORM_CYCLE (1 << 2) /* CONFIG_SYNC: SYNC.cycle is the cycle of all transducers */
+#define EXT_FLAG_SYNC_PROC_PERIOD (1 << 3)   /* CONFIG_SYNC: set the interval of sync0() from SYNC.proc_period */
+#define EXT_FLAG_SEQ_WINDOW (1 << 4)         /* treat msg_id as a sequence number from the next frame on, until MSG_CLEAR */
+#define EXT_FLAG_URGENT (1 << 5)             /* header-only frame applied ahead of the queue, see is_urgent */
+
+#define EXT_OP_NONE (0x00)
+#define EXT_OP_POSE (0x01)
+#define EXT_OP_FOCUS (0x02)
+#define EXT_OP_SPARSE (0x03)
+#define EXT_OP_PHASE_OFFSET (0x04)
+#define EXT_OP_AMP (0x05)
+#define EXT_OP_PHASE_AMP (0x06)
+#define EXT_OP_UNIFORM_PHASE (0x07)
+#define EXT_OP_UNIFORM_DUTY (0x08)
+#define EXT_OP_STOP (0x09)
+#define EXT_OP_BATCH (0x0A)
+
+/* sub-commands of EXT_OP_BATCH; each record starts with a word of type (7:0) and payload length in words (15:8) */
+#define BATCH_END (0x00)
+#define BATCH_SILENCER (0x01)  /* step, cycle */
+#define BATCH_MOD_DELAY (0x02) /* first transducer index, delays */
+#define BATCH_CTL_REG (0x03)   /* pairs of controller address and value */
+#define BATCH_MOD (0x04)       /* flags (BATCH_MOD_BEGIN/END), freq_div (2 words), sample count, samples */
+#define BATCH_NORMAL (0x05)    /* first Normal BRAM address, values */
+
+#define BATCH_MOD_BEGIN (1 << 0)
+#define BATCH_MOD_END (1 << 1)
+
+#define ERR_QUEUE_FULL (1 << 0)        /* frame left unacknowledged until a slot was free */
+#define ERR_INVALID_MSG_ID (1 << 1)    /* frame ignored */
+#define ERR_INVALID_DATA_MODE (1 << 2) /* Gain STM frame ignored */
+#define ERR_PENDING_FULL (1 << 3)      /* timed frame had to wait in the queue */
+#define ERR_OUT_OF_WINDOW (1 << 4)     /* frame beyond the window left unacknowledged */
+#define ERR_INVALID_BATCH (1 << 5)     /* rest of a batch ignored after a malformed record */
+#define ERR_INVALID_TIMED (1 << 6)     /* activation time of an STM frame ignored */
+#define ERR_PRIO_FULL (1 << 7)         /* urgent frame left unacknowledged until the priority lane had room */
+
+#define TELEMETRY_CPU_VERSION (0)
+#define TELEMETRY_FPGA_VERSION (1)
+#define TELEMETRY_FPGA_INFO (2)
+#define TELEMETRY_SYNC0_DIV (3)
+#define TELEMETRY_NUM (4)
+
+#define SPARSE_IDX_DUTY (0x8000)
+#define SPARSE_IDX_MASK (0x01FF)
 
 #define MSG_CLEAR (0x00)
 #define MSG_RD_CPU_VERSION (0x01)
@@ -41,17 +106,31 @@
 #define MSG_RD_FPGA_FUNCTION (0x04)
 #define MSG_BEGIN (0x05)
 #define MSG_END (0xF0)
+#define MSG_RETRY (0xFF) /* set to _msg_id when a frame was not taken, so that its retransmission is not dropped as a duplicate */
+
+#define SEQ_NUM (MSG_END - MSG_BEGIN + 1)
+#define SEQ_WINDOW (8)
 
 extern RX_STR0 _sRx0;
 extern RX_STR1 _sRx1;
 extern TX_STR _sTx;
 
-// fire when ethercat packet arrives
+// fire when ethercat packet arrives; never blocks: a frame that does not fit in the queue is left unacknowledged,
+// so the host keeps sending it and it is taken again once poll(), sync0() or update() has freed a slot
 extern void recv_ethercat(void);
 // fire once after power on
 extern void init_app(void);
-// fire periodically with 1ms interval
+// fire periodically with 1ms interval; also applies queued frames until poll() or sync0() is called for the first time,
+// so a platform that only calls recv_ethercat and update keeps working
 extern void update(void);
+// fire continuously from the main loop (or from a low priority software interrupt pended after recv_ethercat)
+extern void poll(void);
+// fire on every EtherCAT SYNC0 event; alternative to poll() for applying frames at a fixed phase of the bus cycle
+extern void sync0(void);
+// recv_ethercat may preempt update, poll and sync0, but must not be preempted by any of them.
+// recv_ethercat only queues frames, and defers MSG_CLEAR and synchronization to the context that applies the queue,
+// except that it applies a frame itself when nothing is queued or being applied.
+// update, poll and sync0 may preempt each other; the queue is applied by one of them at a time.
 
 typedef enum {
   LEGACY_MODE = 1 << CTL_REG_LEGACY_MODE_BIT,
@@ -94,6 +173,37 @@ typedef struct {
       uint16_t step;
       uint8_t _data[120];
     } SILENT;
+    struct {
+      uint16_t _silent[2];
+      int16_t rot[9];   /* device rotation (local to world), row-major, Q14 */
+      uint16_t _reserved;
+      int32_t trans[3]; /* device origin in world, same unit as Point STM */
+      uint8_t _data[84];
+    } POSE;
+    struct {
+      uint16_t _silent[2];
+      int32_t pos[3];   /* focal point, same unit as Point STM (world frame if a pose is set) */
+      uint32_t wavenum; /* phase count per Point STM unit, Q16 */
+      uint16_t duty;    /* duty ratio, Q16 */
+      uint8_t _data[98];
+    } FOCUS;
+    struct {
+      uint16_t _silent[2];
+      uint16_t value; /* phase or duty applied to all transducers */
+      uint8_t _data[118];
+    } UNIFORM;
+    struct {
+      uint16_t _silent[2];
+      uint32_t proc_period; /* interval of applying queued frames on sync0() in ns, 0 = every SYNC0, with EXT_FLAG_SYNC_PROC_PERIOD */
+      uint16_t cycle;       /* cycle of all transducers, with EXT_FLAG_SYNC_UNIFORM_CYCLE */
+      uint8_t _data[114];
+    } SYNC;
+    struct {
+      uint8_t _data[112];
+      uint16_t flags; /* EXT_FLAG_*, only valid with EXT_MARKER */
+      uint16_t _reserved;
+      uint32_t time[2]; /* DC system time in ns (low, high) at which the frame takes effect, with EXT_FLAG_TIMED */
+    } EXT;
   } DATA;
 } GlobalHeader;
 
@@ -120,12 +230,22 @@ typedef struct {
     struct {
       uint16_t data[TRANS_NUM];
     } MOD_DELAY_DATA;
+    struct {
+      uint16_t data[TRANS_NUM];
+    } BATCH;
   } DATA;
 } Body;
 
+typedef struct {
+  uint32_t index;       /* _accept_cnt when the (first) frame was accepted */
+  uint32_t prev_msg_id; /* msg_id accepted just before it; all frames up to this one are applied while this one is outstanding */
+} Track;
+
 static volatile uint16_t _ack = 0;
 static volatile uint8_t _msg_id = 0;
 static volatile bool_t _read_fpga_info;
+static volatile uint16_t _err = 0;
+static volatile uint16_t _telemetry_id = 0;
 
 static volatile uint16_t _cycle[TRANS_NUM];
 
@@ -133,133 +253,681 @@ static volatile uint32_t _mod_cycle = 0;
 
 static volatile uint32_t _stm_cycle = 0;
 static volatile uint16_t _seq_gain_data_mode = GAIN_DATA_MODE_PHASE_DUTY_FULL;
+static volatile uint16_t _gain_stm_phase_width = 0;
+static volatile uint16_t _gain_stm_duty_width = 0;
+static volatile bool_t _gain_stm_lut = false;
+static uint16_t _gain_stm_phase_lut[256];
+static uint16_t _gain_stm_duty_lut[256];
+static uint16_t _gain_stm_pattern[TRANS_NUM << 1]; /* last Gain STM pattern, same layout as STM BRAM */
+
+static uint16_t _normal_shadow[TRANS_NUM << 1]; /* mirror of Normal BRAM */
+
+static volatile bool_t _phase_offset_enabled = false;
+static uint16_t _phase_offset_upload[TRANS_NUM]; /* as uploaded by PHASE_OFFSET, kept across cycle changes */
+static uint16_t _phase_offset[TRANS_NUM];        /* in units of cycle[i], less than cycle[i] */
+static uint16_t _phase_offset_legacy[TRANS_NUM]; /* in units of 1/256 */
+
+#define CTL_SHADOW_SIZE (BRAM_ADDR_SOUND_SPEED_1 + 1)
+static uint16_t _ctl_shadow[CTL_SHADOW_SIZE];
+static uint32_t _ctl_shadow_valid[(CTL_SHADOW_SIZE + 31) >> 5];
+static uint16_t _normal_buf[TRANS_NUM << 1];
+
+static volatile bool_t _pose_enabled = false;
+static volatile int32_t _pose_rot[9];
+static volatile int32_t _pose_trans[3];
+
+static int32_t _trans_pos[TRANS_NUM][2]; /* Point STM unit, Q4 */
 
+/* records in the ring are a length word (in bytes, including itself; 0 = wrap to the beginning), a Track, a GlobalHeader, and a Body only if has_body() */
 #define BUF_SIZE (32)
-static volatile GlobalHeader _head_buf[BUF_SIZE];
-static volatile Body _body_buf[BUF_SIZE];
-volatile uint32_t _write_cursor;
-volatile uint32_t _read_cursor;
+#define RECORD_HEAD_SIZE (sizeof(uint32_t) + sizeof(Track))
+#define RECORD_BODY_SIZE ((sizeof(Body) + 3) & ~3u)
+#define RING_SIZE (BUF_SIZE * (RECORD_HEAD_SIZE + sizeof(GlobalHeader) + RECORD_BODY_SIZE))
+static volatile uint32_t _ring[RING_SIZE >> 2];
+volatile uint32_t _write_cursor; /* in bytes */
+volatile uint32_t _read_cursor;  /* in bytes */
+static volatile uint32_t _last_record; /* offset of the last pushed record */
+static volatile bool_t _last_record_sealed = false; /* an urgent frame arrived after the last record, so it must not be coalesced */
+static volatile uint32_t _push_cnt = 0;
+static volatile uint32_t _pop_cnt = 0;
+
+/* urgent header-only frames are applied before the ring, and supersede what the frames queued before them would write */
+#define PRIO_BUF_SIZE (4)
+static volatile GlobalHeader _prio_buf[PRIO_BUF_SIZE];
+static volatile uint32_t _prio_barrier[PRIO_BUF_SIZE]; /* _push_cnt when the frame arrived */
+static volatile Track _prio_track[PRIO_BUF_SIZE];
+static volatile uint32_t _prio_write_cursor = 0;
+static volatile uint32_t _prio_read_cursor = 0;
+
+#define SUPERSEDED_CTL_REG (1 << 0)
+#define SUPERSEDED_SILENCER (1 << 1)
+#define SUPERSEDED_PHASE (1 << 2) /* phase lane of Normal BRAM */
+#define SUPERSEDED_DUTY (1 << 3)  /* duty lane of Normal BRAM */
+static volatile uint32_t _ctl_reg_barrier = 0; /* frames pushed before these counts are superseded */
+static volatile uint32_t _silencer_barrier = 0;
+static volatile uint32_t _phase_barrier = 0;
+static volatile uint32_t _duty_barrier = 0;
 
 static volatile GlobalHeader _head;
 static volatile Body _body;
 
-bool_t push(const volatile GlobalHeader* head, const volatile Body* body) {
-  uint32_t next;
-  next = _write_cursor + 1;
+static volatile bool_t _seq_window = false; /* false until a frame with EXT_FLAG_SEQ_WINDOW after MSG_CLEAR */
+static volatile uint8_t _seq_expected = MSG_BEGIN; /* next msg_id in sequence; the one before it is acknowledged */
+static GlobalHeader _reorder_head[SEQ_WINDOW];
+static Body _reorder_body[SEQ_WINDOW];
+static uint8_t _reorder_seq[SEQ_WINDOW]; /* msg_id of the frame received ahead of _seq_expected, 0 = empty */
+
+static uint32_t _recv_time[256]; /* DC time (lower 32 bits) at which each msg_id was accepted */
+
+static volatile uint32_t _accept_cnt = 0;      /* frames accepted since power on */
+static volatile uint8_t _last_accepted_id = 0; /* msg_id of the last accepted frame */
+
+#define PENDING_SIZE (8)
+static GlobalHeader _pending_head[PENDING_SIZE];
+static Body _pending_body[PENDING_SIZE];
+static uint64_t _pending_time[PENDING_SIZE];
+static uint32_t _pending_index[PENDING_SIZE]; /* _pop_cnt when popped, to find out what has been superseded by the time it is applied */
+static volatile Track _pending_track[PENDING_SIZE];
+static volatile bool_t _pending_used[PENDING_SIZE]; /* cleared only after the frame is applied */
+static uint32_t _pending_order[PENDING_SIZE]; /* slot indices, the first _pending_num are sorted by activation time */
+static uint32_t _pending_num = 0;
+
+static volatile uint32_t _sync0_div = 1;
+static volatile uint32_t _sync0_cnt = 0;
+
+static volatile bool_t _processing = false;    /* process() is applying a popped frame */
+static volatile Track _inflight;                /* popped frame not yet applied or held */
+static volatile bool_t _inflight_valid = false;
+static volatile bool_t _drain_external = false; /* poll() or sync0() has been called, so update() leaves the queue to them */
+static volatile bool_t _drain_sync0 = false;    /* sync0() has been called, so frames are applied on the SYNC0 cadence */
+static volatile bool_t _draining = false;       /* drain() is running, possibly preempted by the caller of another */
+static volatile uint32_t _clear_req_cnt = 0;     /* MSG_CLEARs received */
+static volatile uint32_t _clear_done_cnt = 0;    /* MSG_CLEARs for which drain() has reset the device and dropped the frames before them */
+static volatile uint32_t _clear_push_cnt = 0;    /* _push_cnt when the last MSG_CLEAR was received */
+static volatile uint32_t _clear_prio_cursor = 0; /* _prio_write_cursor when the last MSG_CLEAR was received */
+static volatile bool_t _mod_uploading = false; /* Modulation upload queued from MOD_BEGIN but not yet MOD_END */
+static volatile bool_t _stm_uploading = false; /* STM upload queued from STM_BEGIN but not yet STM_END */
+
+inline static volatile uint32_t* ring_at(uint32_t offset) { return &_ring[offset >> 2]; }
+inline static volatile Track* ring_track(uint32_t offset) { return (volatile Track*)ring_at(offset + sizeof(uint32_t)); }
+inline static volatile GlobalHeader* ring_header(uint32_t offset) { return (volatile GlobalHeader*)ring_at(offset + RECORD_HEAD_SIZE); }
+inline static volatile Body* ring_body(uint32_t offset) { return (volatile Body*)ring_at(offset + RECORD_HEAD_SIZE + sizeof(GlobalHeader)); }
+
+inline static bool_t is_clear_pending(void) { return _clear_req_cnt != _clear_done_cnt; }
+
+inline static bool_t is_sync(const volatile GlobalHeader* head) { return (head->cpu_ctl_reg & MOD) == 0 && (head->cpu_ctl_reg & CONFIG_SYNC) != 0; }
+
+// a sync frame reads the cycles from the body even without WRITE_BODY
+inline static bool_t has_body(const volatile GlobalHeader* head) { return (head->cpu_ctl_reg & WRITE_BODY) != 0 || is_sync(head); }
+
+inline static uint32_t record_size(const volatile GlobalHeader* head) {
+  return RECORD_HEAD_SIZE + sizeof(GlobalHeader) + (has_body(head) ? RECORD_BODY_SIZE : 0);
+}
 
-  if (next >= BUF_SIZE) next = 0;
+bool_t push(const volatile GlobalHeader* head, const volatile Body* body, const Track* track) {
+  uint32_t size = record_size(head);
+  uint32_t write = _write_cursor;
+  uint32_t read = _read_cursor;
+  uint32_t pos = write;
+  uint32_t next;
 
-  if (next == _read_cursor) return false;
+  if (write >= read) {
+    if (write + size > RING_SIZE) {
+      if (size >= read) return false;
+      pos = 0;
+    } else if (write + size == RING_SIZE && read == 0) {
+      return false;
+    }
+  } else if (write + size >= read) {
+    return false;
+  }
 
-  memcpy_volatile(&_head_buf[_write_cursor], head, sizeof(GlobalHeader));
-  memcpy_volatile(&_body_buf[_write_cursor], body, sizeof(Body));
+  *ring_track(pos) = *track;
+  memcpy_volatile(ring_header(pos), head, sizeof(GlobalHeader));
+  if (has_body(head)) memcpy_volatile(ring_body(pos), body, sizeof(Body));
+  *ring_at(pos) = size;
+  if (pos != write) *ring_at(write) = 0;
 
   // dmb?
 
+  next = pos + size;
+  if (next >= RING_SIZE) next = 0;
+  _last_record = pos;
+  _last_record_sealed = false;
+  _push_cnt++;
   _write_cursor = next;
 
   return true;
 }
 
-bool_t pop(volatile GlobalHeader* head, volatile Body* body) {
+inline static bool_t is_queue_empty(void) { return _read_cursor == _write_cursor; }
+inline static uint32_t get_queue_depth(void) { return _push_cnt - _pop_cnt; }
+inline static bool_t is_before(uint32_t index, uint32_t barrier) { return (int32_t)(index - barrier) < 0; }
+inline static bool_t is_prio_empty(void) { return _prio_read_cursor == _prio_write_cursor; }
+
+// offset of the next record to be popped; the queue must not be empty
+inline static uint32_t front_record(void) { return *ring_at(_read_cursor) == 0 ? 0 : _read_cursor; }
+
+// header of the next record to be popped, or 0 if the queue is empty
+static volatile GlobalHeader* peek(void) {
+  if (is_queue_empty()) return 0;
+  return ring_header(front_record());
+}
+
+// track is written before the record leaves the ring, so that the frame is never lost from sight of publish_applied()
+bool_t pop(volatile GlobalHeader* head, volatile Body* body, volatile Track* track) {
+  uint32_t read = _read_cursor;
   uint32_t next;
 
-  if (_read_cursor == _write_cursor) return false;
+  if (read == _write_cursor) return false;
 
   // dmb?
 
-  memcpy_volatile(head, &_head_buf[_read_cursor], sizeof(GlobalHeader));
-  memcpy_volatile(body, &_body_buf[_read_cursor], sizeof(Body));
+  if (*ring_at(read) == 0) read = 0;
 
-  next = _read_cursor + 1;
-  if (next >= BUF_SIZE) next = 0;
+  memcpy_volatile(head, ring_header(read), sizeof(GlobalHeader));
+  if (has_body(head)) memcpy_volatile(body, ring_body(read), sizeof(Body));
+  *track = *ring_track(read);
+  _inflight_valid = true;
 
+  next = read + *ring_at(read);
+  if (next >= RING_SIZE) next = 0;
+
+  _pop_cnt++;
   _read_cursor = next;
 
   return true;
 }
 
-void synchronize(const volatile GlobalHeader* header, const volatile Body* body) {
-  const volatile uint16_t* cycle = body->DATA.CYCLE.cycle;
-  volatile uint64_t next_sync0 = ECATC.DC_CYC_START_TIME.LONGLONG;
+inline static void ctl_write_force(uint16_t addr, uint16_t value) {
+  _ctl_shadow[addr] = value;
+  _ctl_shadow_valid[addr >> 5] |= 1ul << (addr & 0x1F);
+  bram_write(BRAM_SELECT_CONTROLLER, addr, value);
+}
 
-  bram_cpy_volatile(BRAM_SELECT_CONTROLLER, BRAM_ADDR_CYCLE_BASE, cycle, TRANS_NUM);
-  bram_cpy_volatile(BRAM_SELECT_CONTROLLER, BRAM_ADDR_EC_SYNC_TIME_0, (volatile uint16_t*)&next_sync0, sizeof(uint64_t) >> 1);
+// controller registers are only written when their value changes
+inline static void ctl_write(uint16_t addr, uint16_t value) {
+  if ((_ctl_shadow_valid[addr >> 5] & (1ul << (addr & 0x1F))) != 0 && _ctl_shadow[addr] == value) return;
+  ctl_write_force(addr, value);
+}
 
-  bram_write(BRAM_SELECT_CONTROLLER, BRAM_ADDR_CTL_REG, header->fpga_ctl_reg | SYNC);
+inline static void ctl_cpy(uint16_t addr, const uint16_t* values, uint32_t cnt) {
+  while (cnt-- > 0) ctl_write(addr++, *values++);
+}
 
-  memcpy_volatile(_cycle, cycle, TRANS_NUM * sizeof(uint16_t));
+static void ctl_invalidate(void) { memset_volatile(_ctl_shadow_valid, 0x00, sizeof(_ctl_shadow_valid)); }
+
+// derive the offsets reduced modulo the current cycle, so calibrate_phase needs a single wrap, and the legacy table
+// from the uploaded ones, which are left untouched so that a later cycle change starts from them again
+static void update_phase_offset(void) {
+  uint32_t i;
+  bool_t enabled = false;
+  for (i = 0; i < TRANS_NUM; i++) {
+    if (_cycle[i] == 0) {
+      _phase_offset[i] = 0;
+      _phase_offset_legacy[i] = 0;
+      continue;
+    }
+    _phase_offset[i] = _phase_offset_upload[i] % _cycle[i];
+    _phase_offset_legacy[i] = ((uint32_t)_phase_offset[i] << 8) / _cycle[i];
+    if (_phase_offset[i] != 0) enabled = true;
+  }
+  _phase_offset_enabled = enabled;
 }
 
-void write_mod(const volatile GlobalHeader* header) {
-  uint32_t freq_div;
-  uint16_t* data;
-  uint32_t segment_capacity;
-  uint32_t write = header->size;
+static void set_phase_offset(const volatile Body* body) {
+  memcpy_volatile(_phase_offset_upload, body->DATA.NORMAL.data, TRANS_NUM * sizeof(uint16_t));
+  update_phase_offset();
+}
 
-  if ((header->cpu_ctl_reg & MOD_BEGIN) != 0) {
-    _mod_cycle = 0;
-    bram_write(BRAM_SELECT_CONTROLLER, BRAM_ADDR_MOD_ADDR_OFFSET, 0);
-    freq_div = header->DATA.MOD_HEAD.freq_div;
-    bram_cpy(BRAM_SELECT_CONTROLLER, BRAM_ADDR_MOD_FREQ_DIV_0, (uint16_t*)&freq_div, sizeof(uint32_t) >> 1);
-    data = (uint16_t*)header->DATA.MOD_HEAD.data;
-  } else {
-    data = (uint16_t*)header->DATA.MOD_BODY.data;
+// add the calibration offset to the phase part of a word, wrapping at cycle[i]
+inline static uint16_t calibrate_phase(uint32_t i, uint16_t value, bool_t legacy) {
+  uint32_t phase;
+  if (!_phase_offset_enabled) return value;
+  if (legacy) return (value & 0xFF00) | ((value + _phase_offset_legacy[i]) & 0x00FF);
+  phase = value + _phase_offset[i];
+  return phase >= _cycle[i] ? phase - _cycle[i] : phase;
+}
+
+inline static uint64_t get_dc_sys_time(void) { return ECATC.DC_SYS_TIME.LONGLONG; }
+inline static uint64_t get_next_sync0_time(void) { return ECATC.DC_CYC_START_TIME.LONGLONG; }
+inline static uint32_t get_sync0_cycle_time(void) { return ECATC.DC_CYC_TIME0.LONG; }
+
+// size is only meaningful for modulation frames; other frames carry the extended operation code there, marked by EXT_MARKER
+inline static bool_t has_ext(const volatile GlobalHeader* header) { return (header->cpu_ctl_reg & MOD) == 0 && (header->size & EXT_MARKER) != 0; }
+inline static uint8_t get_ext_op(const volatile GlobalHeader* header) { return has_ext(header) ? header->size & EXT_OP_MASK : EXT_OP_NONE; }
+inline static uint16_t get_ext_flags(const volatile GlobalHeader* header) { return has_ext(header) ? header->DATA.EXT.flags : 0; }
+
+static void set_proc_period(uint32_t period) {
+  uint32_t sync0_cycle = get_sync0_cycle_time();
+  _sync0_div = (period == 0 || sync0_cycle == 0) ? 1 : max(1, (period + (sync0_cycle >> 1)) / sync0_cycle);
+  _sync0_cnt = 0;
+}
+
+// without extended flags, the cycles of all transducers are in body
+void synchronize(const volatile GlobalHeader* header, const volatile Body* body) {
+  const volatile uint16_t* cycle = body->DATA.CYCLE.cycle;
+  uint16_t flags = get_ext_flags(header);
+  uint16_t uniform_cycle = header->DATA.SYNC.cycle;
+  volatile uint64_t next_sync0 = get_next_sync0_time();
+  uint32_t i;
+
+  if ((flags & EXT_FLAG_SYNC_KEEP_CYCLE) == 0) {
+    if ((flags & EXT_FLAG_SYNC_UNIFORM_CYCLE) != 0)
+      bram_set(BRAM_SELECT_CONTROLLER, BRAM_ADDR_CYCLE_BASE, uniform_cycle, TRANS_NUM);
+    else
+      bram_cpy_volatile(BRAM_SELECT_CONTROLLER, BRAM_ADDR_CYCLE_BASE, cycle, TRANS_NUM);
   }
+  bram_cpy_volatile(BRAM_SELECT_CONTROLLER, BRAM_ADDR_EC_SYNC_TIME_0, (volatile uint16_t*)&next_sync0, sizeof(uint64_t) >> 1);
+
+  ctl_write_force(BRAM_ADDR_CTL_REG, header->fpga_ctl_reg | SYNC);
+
+  if ((flags & EXT_FLAG_SYNC_KEEP_CYCLE) == 0) {
+    if ((flags & EXT_FLAG_SYNC_UNIFORM_CYCLE) != 0)
+      for (i = 0; i < TRANS_NUM; i++) _cycle[i] = uniform_cycle;
+    else
+      memcpy_volatile(_cycle, cycle, TRANS_NUM * sizeof(uint16_t));
+  }
+  update_phase_offset();
+
+  if ((flags & EXT_FLAG_SYNC_PROC_PERIOD) != 0) set_proc_period(header->DATA.SYNC.proc_period);
+}
 
-  segment_capacity = (_mod_cycle & ~MOD_BUF_SEGMENT_SIZE_MASK) + MOD_BUF_SEGMENT_SIZE - _mod_cycle;
+static void append_mod(const uint16_t* data, uint32_t write) {
+  uint32_t segment_capacity = (_mod_cycle & ~MOD_BUF_SEGMENT_SIZE_MASK) + MOD_BUF_SEGMENT_SIZE - _mod_cycle;
   if (write <= segment_capacity) {
     bram_cpy(BRAM_SELECT_MOD, (_mod_cycle & MOD_BUF_SEGMENT_SIZE_MASK) >> 1, data, (write + 1) >> 1);
     _mod_cycle += write;
   } else {
     bram_cpy(BRAM_SELECT_MOD, (_mod_cycle & MOD_BUF_SEGMENT_SIZE_MASK) >> 1, data, segment_capacity >> 1);
     _mod_cycle += segment_capacity;
-    data += segment_capacity;
-    bram_write(BRAM_SELECT_CONTROLLER, BRAM_ADDR_MOD_ADDR_OFFSET, (_mod_cycle & ~MOD_BUF_SEGMENT_SIZE_MASK) >> MOD_BUF_SEGMENT_SIZE_WIDTH);
+    data += segment_capacity >> 1;
+    ctl_write(BRAM_ADDR_MOD_ADDR_OFFSET, (_mod_cycle & ~MOD_BUF_SEGMENT_SIZE_MASK) >> MOD_BUF_SEGMENT_SIZE_WIDTH);
     bram_cpy(BRAM_SELECT_MOD, (_mod_cycle & MOD_BUF_SEGMENT_SIZE_MASK) >> 1, data, (write - segment_capacity + 1) >> 1);
     _mod_cycle += write - segment_capacity;
   }
+}
+static void begin_mod(uint32_t freq_div) {
+  _mod_cycle = 0;
+  ctl_write(BRAM_ADDR_MOD_ADDR_OFFSET, 0);
+  ctl_cpy(BRAM_ADDR_MOD_FREQ_DIV_0, (uint16_t*)&freq_div, sizeof(uint32_t) >> 1);
+}
+inline static void end_mod(void) { ctl_write(BRAM_ADDR_MOD_CYCLE, max(1, _mod_cycle) - 1); }
+
+void write_mod(const volatile GlobalHeader* header) {
+  uint16_t* data;
+  uint32_t write = header->size;
 
-  if ((header->cpu_ctl_reg & MOD_END) != 0) bram_write(BRAM_SELECT_CONTROLLER, BRAM_ADDR_MOD_CYCLE, max(1, _mod_cycle) - 1);
+  if ((header->cpu_ctl_reg & MOD_BEGIN) != 0) {
+    begin_mod(header->DATA.MOD_HEAD.freq_div);
+    data = (uint16_t*)header->DATA.MOD_HEAD.data;
+  } else {
+    data = (uint16_t*)header->DATA.MOD_BODY.data;
+  }
+
+  append_mod(data, write);
+
+  if ((header->cpu_ctl_reg & MOD_END) != 0) end_mod();
 }
 
 void config_silencer(const volatile GlobalHeader* header) {
   uint16_t step = header->DATA.SILENT.step;
   uint16_t cycle = header->DATA.SILENT.cycle;
-  bram_write(BRAM_SELECT_CONTROLLER, BRAM_ADDR_SILENT_STEP, step);
-  bram_write(BRAM_SELECT_CONTROLLER, BRAM_ADDR_SILENT_CYCLE, cycle);
+  ctl_write(BRAM_ADDR_SILENT_STEP, step);
+  ctl_write(BRAM_ADDR_SILENT_CYCLE, cycle);
+}
+
+// STM frames are never held, since the patterns of later frames are written at offsets that follow from this one
+inline static bool_t is_timed_stm(const volatile GlobalHeader* header) {
+  return (get_ext_flags(header) & EXT_FLAG_TIMED) != 0 && (header->fpga_ctl_reg & OP_MODE) != 0;
+}
+inline static uint64_t get_activation_time(const volatile GlobalHeader* header) {
+  if ((get_ext_flags(header) & EXT_FLAG_TIMED) == 0 || is_timed_stm(header)) return 0;
+  return ((uint64_t)header->DATA.EXT.time[1] << 32) | header->DATA.EXT.time[0];
+}
+
+static void set_pose(const volatile GlobalHeader* header) {
+  uint32_t i;
+  bool_t identity = true;
+  for (i = 0; i < 9; i++) {
+    _pose_rot[i] = header->DATA.POSE.rot[i];
+    if (_pose_rot[i] != ((i % 4) == 0 ? (1 << POSE_ROT_FRAC_WIDTH) : 0)) identity = false;
+  }
+  for (i = 0; i < 3; i++) {
+    _pose_trans[i] = header->DATA.POSE.trans[i];
+    if (_pose_trans[i] != 0) identity = false;
+  }
+  _pose_enabled = !identity;
+}
+
+inline static int32_t sign_extend_point(uint32_t v) {
+  return (int32_t)(v << (32 - POINT_STM_FIXED_NUM_WIDTH)) >> (32 - POINT_STM_FIXED_NUM_WIDTH);
+}
+
+inline static uint32_t saturate_point(int64_t v) {
+  const int64_t lim = 1 << (POINT_STM_FIXED_NUM_WIDTH - 1);
+  if (v >= lim) v = lim - 1;
+  if (v < -lim) v = -lim;
+  return (uint32_t)v & ((1 << POINT_STM_FIXED_NUM_WIDTH) - 1);
+}
+
+// p_local = R^T (p_world - t)
+static void world_to_local(const int32_t* p, int64_t* l) {
+  int32_t d[3];
+  uint32_t i;
+
+  for (i = 0; i < 3; i++) d[i] = p[i] - _pose_trans[i];
+
+  for (i = 0; i < 3; i++)
+    l[i] = ((int64_t)_pose_rot[i] * d[0] + (int64_t)_pose_rot[3 + i] * d[1] + (int64_t)_pose_rot[6 + i] * d[2] +
+            (1 << (POSE_ROT_FRAC_WIDTH - 1))) >>
+           POSE_ROT_FRAC_WIDTH;
+}
+
+static void transform_point(volatile uint16_t* dst, const volatile uint16_t* src) {
+  uint16_t w3 = src[3];
+  int32_t p[3];
+  int64_t l[3];
+  uint32_t x, y, z;
+
+  p[0] = sign_extend_point(((uint32_t)(src[1] & 0x0003) << 16) | src[0]);
+  p[1] = sign_extend_point(((uint32_t)(src[2] & 0x000F) << 14) | (src[1] >> 2));
+  p[2] = sign_extend_point(((uint32_t)(w3 & 0x003F) << 12) | (src[2] >> 4));
+
+  world_to_local(p, l);
+
+  x = saturate_point(l[0]);
+  y = saturate_point(l[1]);
+  z = saturate_point(l[2]);
+
+  dst[0] = x & 0xFFFF;
+  dst[1] = ((y & 0x3FFF) << 2) | (x >> 16);
+  dst[2] = ((z & 0x0FFF) << 4) | (y >> 14);
+  dst[3] = (w3 & 0xFFC0) | (z >> 12);
+}
+
+static const volatile uint16_t* write_points(volatile uint16_t* dst, const volatile uint16_t* src, uint32_t cnt) {
+  if (_pose_enabled) {
+    while (cnt--) {
+      transform_point(dst, src);
+      src += 4;
+      dst += 8;
+    }
+    return src;
+  }
+  while (cnt--) {
+    *dst++ = *src++;
+    *dst++ = *src++;
+    *dst++ = *src++;
+    *dst++ = *src++;
+    dst += 4;
+  }
+  return src;
+}
+
+inline static bool_t is_missing_transducer(uint32_t x, uint32_t y) { return y == 1 && (x == 1 || x == 2 || x == 16); }
+
+static void init_trans_pos(void) {
+  uint32_t x, y;
+  uint32_t i = 0;
+  for (y = 0; y < TRANS_NUM_Y; y++)
+    for (x = 0; x < TRANS_NUM_X; x++) {
+      if (is_missing_transducer(x, y)) continue;
+      _trans_pos[i][0] = (x * (TRANS_SPACING_NUM << TRANS_POS_FRAC_WIDTH) + (TRANS_SPACING_DEN >> 1)) / TRANS_SPACING_DEN;
+      _trans_pos[i][1] = (y * (TRANS_SPACING_NUM << TRANS_POS_FRAC_WIDTH) + (TRANS_SPACING_DEN >> 1)) / TRANS_SPACING_DEN;
+      i++;
+    }
+}
+
+// phase[i] = |p - pos[i]| * wavenum mod cycle[i]
+static void calc_focus(const volatile GlobalHeader* header, uint16_t* dst, bool_t legacy) {
+  int32_t p[3];
+  int64_t l[3];
+  int64_t fx, fy, fz2;
+  int64_t dx, dy;
+  uint32_t wavenum = header->DATA.FOCUS.wavenum;
+  uint32_t duty_ratio = header->DATA.FOCUS.duty;
+  uint32_t dist, cycle, phase, duty;
+  uint32_t i;
+
+  for (i = 0; i < 3; i++) p[i] = header->DATA.FOCUS.pos[i];
+  if (_pose_enabled) {
+    world_to_local(p, l);
+  } else {
+    for (i = 0; i < 3; i++) l[i] = p[i];
+  }
+  // multiplied rather than shifted, since the coordinates may be negative
+  fx = l[0] * (1 << TRANS_POS_FRAC_WIDTH);
+  fy = l[1] * (1 << TRANS_POS_FRAC_WIDTH);
+  fz2 = l[2] * (1 << TRANS_POS_FRAC_WIDTH) * l[2] * (1 << TRANS_POS_FRAC_WIDTH);
+
+  for (i = 0; i < TRANS_NUM; i++) {
+    dx = fx - _trans_pos[i][0];
+    dy = fy - _trans_pos[i][1];
+    dist = fx_isqrt64((uint64_t)(dx * dx + dy * dy + fz2));
+    cycle = _cycle[i];
+    phase = fx_dist_to_phase(dist, wavenum, TRANS_POS_FRAC_WIDTH + FOCUS_WAVENUM_FRAC_WIDTH, cycle);
+    if (legacy) {
+      phase = cycle == 0 ? 0 : (phase << 8) / cycle;
+      duty = duty_ratio >> 7;
+      if (duty > 0xFF) duty = 0xFF;
+      *dst = (duty << 8) | phase;
+    } else {
+      duty = (cycle * duty_ratio) >> 16;
+      dst[0] = phase;
+      dst[1] = duty;
+    }
+    dst += 2;
+  }
 }
 
 static void set_mod_delay(const volatile Body* body) {
   bram_cpy_volatile(BRAM_SELECT_CONTROLLER, BRAM_ADDR_MOD_DELAY_BASE, body->DATA.MOD_DELAY_DATA.data, TRANS_NUM);
 }
 
-static void write_normal_op_legacy(const volatile Body* body) {
-  volatile uint16_t* base = (volatile uint16_t*)FPGA_BASE;
-  uint16_t addr = get_addr(BRAM_SELECT_NORMAL, 0);
-  uint32_t cnt = TRANS_NUM;
-  volatile uint16_t* dst = &base[addr];
-  const volatile uint16_t* src = body->DATA.NORMAL.data;
+// Normal BRAM cannot be read back, so the CPU keeps a mirror and skips bus writes of unchanged words
+inline static void normal_write(uint32_t addr, uint16_t value) {
+  if (_normal_shadow[addr] == value) return;
+  _normal_shadow[addr] = value;
+  bram_write(BRAM_SELECT_NORMAL, addr, value);
+}
+
+static void normal_cpy(const uint16_t* src, bool_t legacy) {
+  uint32_t i;
+  for (i = 0; i < TRANS_NUM; i++) {
+    normal_write(i << 1, calibrate_phase(i, src[i << 1], legacy));
+    if (!legacy) normal_write((i << 1) + 1, src[(i << 1) + 1]);
+  }
+}
+
+// body: data[0] = n, then n pairs of (index, value); bit 15 of index selects the duty word in non-legacy mode
+inline static uint32_t get_sparse_num(const volatile Body* body) {
+  uint32_t cnt = body->DATA.NORMAL.data[0];
+  return cnt > ((TRANS_NUM - 1) >> 1) ? (TRANS_NUM - 1) >> 1 : cnt;
+}
+
+inline static uint32_t get_sparse_addr(uint16_t idx, bool_t legacy) {
+  return ((idx & SPARSE_IDX_MASK) << 1) + (!legacy && (idx & SPARSE_IDX_DUTY) != 0 ? 1 : 0);
+}
+
+static void apply_sparse(uint16_t* dst, const volatile Body* body, bool_t legacy) {
+  const volatile uint16_t* src = body->DATA.NORMAL.data + 1;
+  uint32_t cnt = get_sparse_num(body);
   while (cnt--) {
-    *dst = *src++;
-    dst += 2;
+    if ((src[0] & SPARSE_IDX_MASK) < TRANS_NUM) dst[get_sparse_addr(src[0], legacy)] = src[1];
+    src += 2;
   }
 }
 
+// lanes of Normal BRAM a frame writes, as SUPERSEDED_PHASE/SUPERSEDED_DUTY
+// a legacy word holds both, so any legacy write is treated as writing both lanes
+static uint8_t get_normal_lanes(const volatile GlobalHeader* header) {
+  bool_t legacy = (header->fpga_ctl_reg & LEGACY_MODE) != 0;
+  if ((header->cpu_ctl_reg & MOD) != 0) return 0;
+  switch (get_ext_op(header)) {
+    case EXT_OP_UNIFORM_PHASE:
+      return SUPERSEDED_PHASE;
+    case EXT_OP_UNIFORM_DUTY:
+      return SUPERSEDED_DUTY;
+    case EXT_OP_STOP:
+      return legacy ? SUPERSEDED_PHASE | SUPERSEDED_DUTY : SUPERSEDED_DUTY;
+    case EXT_OP_FOCUS:
+      return (header->fpga_ctl_reg & OP_MODE) == 0 ? SUPERSEDED_PHASE | SUPERSEDED_DUTY : 0;
+    default:
+      break;
+  }
+  if ((header->cpu_ctl_reg & WRITE_BODY) == 0 || (header->cpu_ctl_reg & MOD_DELAY) != 0 || (header->fpga_ctl_reg & OP_MODE) != 0) return 0;
+  switch (get_ext_op(header)) {
+    case EXT_OP_AMP:
+      return SUPERSEDED_DUTY;
+    case EXT_OP_SPARSE:
+    case EXT_OP_PHASE_AMP:
+      return SUPERSEDED_PHASE | SUPERSEDED_DUTY;
+    case EXT_OP_NONE:
+      if (legacy) return SUPERSEDED_PHASE | SUPERSEDED_DUTY;
+      return (header->cpu_ctl_reg & IS_DUTY) != 0 ? SUPERSEDED_DUTY : SUPERSEDED_PHASE;
+    default:
+      return 0;
+  }
+}
+
+inline static uint8_t get_normal_addr_lane(uint32_t addr, bool_t legacy) {
+  if ((addr & 1) != 0) return SUPERSEDED_DUTY;
+  return legacy ? SUPERSEDED_PHASE | SUPERSEDED_DUTY : SUPERSEDED_PHASE;
+}
+
+static void write_normal_op_sparse(const volatile Body* body, bool_t legacy, uint8_t superseded) {
+  const volatile uint16_t* src = body->DATA.NORMAL.data + 1;
+  uint32_t cnt = get_sparse_num(body);
+  uint32_t i, addr;
+  while (cnt--) {
+    i = src[0] & SPARSE_IDX_MASK;
+    if (i < TRANS_NUM) {
+      addr = get_sparse_addr(src[0], legacy);
+      if ((superseded & get_normal_addr_lane(addr, legacy)) == 0) normal_write(addr, (addr & 1) == 0 ? calibrate_phase(i, src[1], legacy) : src[1]);
+    }
+    src += 2;
+  }
+}
+
+static void write_normal_op_legacy(const volatile Body* body) {
+  uint32_t i;
+  const volatile uint16_t* src = body->DATA.NORMAL.data;
+  for (i = 0; i < TRANS_NUM; i++) normal_write(i << 1, calibrate_phase(i, src[i], true));
+}
+
 static void write_normal_op_raw(const volatile Body* body, bool_t is_duty) {
-  volatile uint16_t* base = (volatile uint16_t*)FPGA_BASE;
-  uint16_t addr = get_addr(BRAM_SELECT_NORMAL, 0);
-  uint32_t cnt = TRANS_NUM;
-  volatile uint16_t* dst = &base[addr] + (is_duty ? 1 : 0);
+  uint32_t i;
   const volatile uint16_t* src = body->DATA.NORMAL.data;
-  while (cnt-- > 0) {
-    *dst = *src++;
-    dst += 2;
+  if (is_duty) {
+    for (i = 0; i < TRANS_NUM; i++) normal_write((i << 1) + 1, src[i]);
+  } else {
+    for (i = 0; i < TRANS_NUM; i++) normal_write(i << 1, calibrate_phase(i, src[i], false));
+  }
+}
+
+// body: 8-bit normalized amplitudes, two per word with the lower byte first
+// only duty is updated; in legacy mode the phase byte is kept from the mirror
+inline static uint16_t amp_to_duty_legacy(uint8_t amp) {
+  uint16_t duty = FX_ASIN[amp] >> 7;
+  return duty > 0xFF ? 0xFF : duty;
+}
+
+static void write_normal_op_amp(const volatile Body* body, bool_t legacy) {
+  const volatile uint8_t* src = (const volatile uint8_t*)body->DATA.NORMAL.data;
+  uint32_t i;
+  if (legacy) {
+    for (i = 0; i < TRANS_NUM; i++) normal_write(i << 1, (amp_to_duty_legacy(src[i]) << 8) | (_normal_shadow[i << 1] & 0x00FF));
+  } else {
+    for (i = 0; i < TRANS_NUM; i++) normal_write((i << 1) + 1, fx_amp_to_duty(src[i], _cycle[i]));
   }
 }
 
-static void write_normal_op(const volatile GlobalHeader* header, const volatile Body* body) {
-  if (header->fpga_ctl_reg & LEGACY_MODE) {
+// body: 7:0 = normalized phase (256 = cycle), 15:8 = normalized amplitude, so that phase and duty are updated in one frame
+static void write_normal_op_phase_amp(const volatile Body* body, bool_t legacy, uint8_t superseded) {
+  const volatile uint16_t* src = body->DATA.NORMAL.data;
+  uint32_t i, cycle;
+  uint16_t v;
+  if (legacy) {
+    for (i = 0; i < TRANS_NUM; i++) {
+      v = src[i];
+      normal_write(i << 1, calibrate_phase(i, (amp_to_duty_legacy(v >> 8) << 8) | (v & 0x00FF), true));
+    }
+  } else {
+    for (i = 0; i < TRANS_NUM; i++) {
+      v = src[i];
+      cycle = _cycle[i];
+      if ((superseded & SUPERSEDED_PHASE) == 0) normal_write(i << 1, calibrate_phase(i, ((v & 0x00FF) * cycle) >> 8, false));
+      if ((superseded & SUPERSEDED_DUTY) == 0) normal_write((i << 1) + 1, fx_amp_to_duty(v >> 8, cycle));
+    }
+  }
+}
+
+static void fill_normal_lane(uint32_t lane, uint16_t value) {
+  uint32_t i;
+  bram_set_stride(BRAM_SELECT_NORMAL, lane, value, TRANS_NUM, 2);
+  for (i = lane; i < (TRANS_NUM << 1); i += 2) _normal_shadow[i] = value;
+}
+static void write_uniform(const volatile GlobalHeader* header) {
+  bool_t legacy = (header->fpga_ctl_reg & LEGACY_MODE) != 0;
+  uint16_t value = header->DATA.UNIFORM.value;
+  uint32_t i;
+  switch (get_ext_op(header)) {
+    case EXT_OP_UNIFORM_PHASE:
+      if (legacy) {
+        for (i = 0; i < TRANS_NUM; i++) normal_write(i << 1, calibrate_phase(i, (_normal_shadow[i << 1] & 0xFF00) | (value & 0x00FF), true));
+      } else if (_phase_offset_enabled) {
+        for (i = 0; i < TRANS_NUM; i++) normal_write(i << 1, calibrate_phase(i, value, false));
+      } else {
+        fill_normal_lane(0, value);
+      }
+      break;
+    case EXT_OP_UNIFORM_DUTY:
+      if (legacy) {
+        for (i = 0; i < TRANS_NUM; i++) normal_write(i << 1, ((value & 0x00FF) << 8) | (_normal_shadow[i << 1] & 0x00FF));
+      } else {
+        fill_normal_lane(1, value);
+      }
+      break;
+    case EXT_OP_STOP:
+      if (legacy)
+        fill_normal_lane(0, 0x0000);
+      else
+        fill_normal_lane(1, 0x0000);
+      break;
+    default:
+      break;
+  }
+}
+
+// sparse and non-legacy phase/amplitude frames skip only the superseded lane; the others are skipped whole
+static void write_normal_op(const volatile GlobalHeader* header, const volatile Body* body, uint8_t superseded) {
+  bool_t legacy = (header->fpga_ctl_reg & LEGACY_MODE) != 0;
+  switch (get_ext_op(header)) {
+    case EXT_OP_SPARSE:
+      write_normal_op_sparse(body, legacy, superseded);
+      return;
+    case EXT_OP_PHASE_AMP:
+      if (!legacy) {
+        write_normal_op_phase_amp(body, legacy, superseded);
+        return;
+      }
+      break;
+    default:
+      break;
+  }
+  if ((superseded & get_normal_lanes(header)) != 0) return;
+  switch (get_ext_op(header)) {
+    case EXT_OP_AMP:
+      write_normal_op_amp(body, legacy);
+      return;
+    case EXT_OP_PHASE_AMP:
+      write_normal_op_phase_amp(body, legacy, superseded);
+      return;
+    default:
+      break;
+  }
+  if (legacy) {
     write_normal_op_legacy(body);
   } else {
     write_normal_op_raw(body, (header->cpu_ctl_reg & IS_DUTY) != 0);
@@ -273,19 +941,19 @@ static void write_point_stm(const volatile GlobalHeader* header, const volatile
   const volatile uint16_t* src;
   uint32_t freq_div;
   uint32_t sound_speed;
-  uint32_t size, cnt;
+  uint32_t size;
   uint32_t segment_capacity;
 
   if ((header->cpu_ctl_reg & STM_BEGIN) != 0) {
     _stm_cycle = 0;
-    bram_write(BRAM_SELECT_CONTROLLER, BRAM_ADDR_STM_ADDR_OFFSET, 0);
+    ctl_write(BRAM_ADDR_STM_ADDR_OFFSET, 0);
 
     size = body->DATA.POINT_STM_HEAD.data[0];
     freq_div = (body->DATA.POINT_STM_HEAD.data[2] << 16) | body->DATA.POINT_STM_HEAD.data[1];
     sound_speed = (body->DATA.POINT_STM_HEAD.data[4] << 16) | body->DATA.POINT_STM_HEAD.data[3];
 
-    bram_cpy(BRAM_SELECT_CONTROLLER, BRAM_ADDR_STM_FREQ_DIV_0, (uint16_t*)&freq_div, sizeof(uint32_t) >> 1);
-    bram_cpy(BRAM_SELECT_CONTROLLER, BRAM_ADDR_SOUND_SPEED_0, (uint16_t*)&sound_speed, sizeof(uint32_t) >> 1);
+    ctl_cpy(BRAM_ADDR_STM_FREQ_DIV_0, (uint16_t*)&freq_div, sizeof(uint32_t) >> 1);
+    ctl_cpy(BRAM_ADDR_SOUND_SPEED_0, (uint16_t*)&sound_speed, sizeof(uint32_t) >> 1);
     src = body->DATA.POINT_STM_HEAD.data + 5;
   } else {
     size = body->DATA.POINT_STM_BODY.data[0];
@@ -294,252 +962,730 @@ static void write_point_stm(const volatile GlobalHeader* header, const volatile
 
   segment_capacity = (_stm_cycle & ~POINT_STM_BUF_SEGMENT_SIZE_MASK) + POINT_STM_BUF_SEGMENT_SIZE - _stm_cycle;
   if (size <= segment_capacity) {
-    cnt = size;
     addr = get_addr(BRAM_SELECT_STM, (_stm_cycle & POINT_STM_BUF_SEGMENT_SIZE_MASK) << 3);
     dst = &base[addr];
-    while (cnt--) {
-      *dst++ = *src++;
-      *dst++ = *src++;
-      *dst++ = *src++;
-      *dst++ = *src++;
-      dst += 4;
-    }
+    write_points(dst, src, size);
     _stm_cycle += size;
   } else {
-    cnt = segment_capacity;
     addr = get_addr(BRAM_SELECT_STM, (_stm_cycle & POINT_STM_BUF_SEGMENT_SIZE_MASK) << 3);
     dst = &base[addr];
-    while (cnt--) {
-      *dst++ = *src++;
-      *dst++ = *src++;
-      *dst++ = *src++;
-      *dst++ = *src++;
-      dst += 4;
-    }
+    src = write_points(dst, src, segment_capacity);
     _stm_cycle += segment_capacity;
 
-    bram_write(BRAM_SELECT_CONTROLLER, BRAM_ADDR_STM_ADDR_OFFSET,
-               (_stm_cycle & ~POINT_STM_BUF_SEGMENT_SIZE_MASK) >> POINT_STM_BUF_SEGMENT_SIZE_WIDTH);
+    ctl_write(BRAM_ADDR_STM_ADDR_OFFSET,
+              (_stm_cycle & ~POINT_STM_BUF_SEGMENT_SIZE_MASK) >> POINT_STM_BUF_SEGMENT_SIZE_WIDTH);
 
-    cnt = size - segment_capacity;
     addr = get_addr(BRAM_SELECT_STM, (_stm_cycle & POINT_STM_BUF_SEGMENT_SIZE_MASK) << 3);
     dst = &base[addr];
-    while (cnt--) {
-      *dst++ = *src++;
-      *dst++ = *src++;
-      *dst++ = *src++;
+    write_points(dst, src, size - segment_capacity);
+    _stm_cycle += size - segment_capacity;
+  }
+
+  if ((header->cpu_ctl_reg & STM_END) != 0) ctl_write(BRAM_ADDR_STM_CYCLE, max(1, _stm_cycle) - 1);
+}
+
+inline static volatile uint16_t* gain_stm_pattern_addr(void) {
+  volatile uint16_t* base = (volatile uint16_t*)FPGA_BASE;
+  return &base[get_addr(BRAM_SELECT_STM, (_stm_cycle & GAIN_STM_BUF_SEGMENT_SIZE_MASK) << 9)];
+}
+
+static void gain_stm_pattern_done(void) {
+  _stm_cycle += 1;
+  if ((_stm_cycle & GAIN_STM_BUF_SEGMENT_SIZE_MASK) == 0)
+    ctl_write(BRAM_ADDR_STM_ADDR_OFFSET, (_stm_cycle & ~GAIN_STM_BUF_SEGMENT_SIZE_MASK) >> GAIN_STM_BUF_SEGMENT_SIZE_WIDTH);
+}
+
+static void gain_stm_commit_pattern(bool_t legacy) {
+  volatile uint16_t* dst = gain_stm_pattern_addr();
+  const uint16_t* src = _gain_stm_pattern;
+  uint32_t i;
+  if (legacy) {
+    for (i = 0; i < TRANS_NUM; i++) {
+      *dst = calibrate_phase(i, *src, true);
+      dst += 2;
+      src += 2;
+    }
+  } else {
+    for (i = 0; i < TRANS_NUM; i++) {
+      *dst++ = calibrate_phase(i, *src++, false);
       *dst++ = *src++;
-      dst += 4;
     }
-    _stm_cycle += size - segment_capacity;
   }
+  gain_stm_pattern_done();
+}
+
+// replicate code bits to fill 8 bits, e.g. 4 bit abcd -> abcdabcd
+static uint16_t expand_code_8bit(uint32_t code, uint32_t width) {
+  uint32_t v = 0;
+  int32_t b = 8;
+  while (b >= (int32_t)width) {
+    b -= width;
+    v |= code << b;
+  }
+  if (b > 0) v |= code >> (width - b);
+  return v & 0xFF;
+}
+
+static bool_t is_cycle_uniform(void) {
+  uint32_t i;
+  for (i = 1; i < TRANS_NUM; i++)
+    if (_cycle[i] != _cycle[0]) return false;
+  return true;
+}
+
+static void set_gain_stm_format(const volatile GlobalHeader* header, const volatile Body* body) {
+  bool_t legacy = (header->fpga_ctl_reg & LEGACY_MODE) != 0;
+  uint32_t phase_width, duty_width;
+  uint32_t phase_lut_width, duty_lut_width;
+  uint32_t cycle = _cycle[0];
+  uint32_t i;
 
-  if ((header->cpu_ctl_reg & STM_END) != 0) bram_write(BRAM_SELECT_CONTROLLER, BRAM_ADDR_STM_CYCLE, max(1, _stm_cycle) - 1);
+  _gain_stm_phase_width = 0;
+  _gain_stm_duty_width = 0;
+  switch (_seq_gain_data_mode) {
+    case GAIN_DATA_MODE_PHASE_FULL:
+      if (legacy) _gain_stm_phase_width = 8;
+      break;
+    case GAIN_DATA_MODE_PHASE_COMPACT:
+      if (!legacy) _gain_stm_phase_width = 8;
+      break;
+    case GAIN_DATA_MODE_PHASE_HALF:
+      _gain_stm_phase_width = 4;
+      break;
+    case GAIN_DATA_MODE_PACKED:
+      phase_width = body->DATA.GAIN_STM_HEAD.data[3];
+      duty_width = body->DATA.GAIN_STM_HEAD.data[4];
+      if (phase_width < 1 || phase_width > 13 || duty_width > 13 || phase_width + duty_width > 16) break;
+      _gain_stm_phase_width = phase_width;
+      _gain_stm_duty_width = duty_width;
+      break;
+    default:
+      return;
+  }
+  if (_gain_stm_phase_width == 0) return;
+
+  phase_width = _gain_stm_phase_width;
+  duty_width = _gain_stm_duty_width;
+  _gain_stm_lut = legacy || (phase_width <= 8 && duty_width <= 8 && is_cycle_uniform());
+  if (!_gain_stm_lut) return;
+
+  // legacy tables are indexed by the upper 8 bits of wider codes
+  phase_lut_width = phase_width > 8 ? 8 : phase_width;
+  duty_lut_width = duty_width > 8 ? 8 : duty_width;
+  for (i = 0; i < (1u << phase_lut_width); i++)
+    _gain_stm_phase_lut[i] = legacy ? expand_code_8bit(i, phase_lut_width) : (i * cycle) >> phase_width;
+  if (duty_width == 0)
+    _gain_stm_duty_lut[0] = legacy ? 0xFF00 : cycle >> 1;
+  else
+    for (i = 0; i < (1u << duty_lut_width); i++)
+      _gain_stm_duty_lut[i] = legacy ? (uint32_t)expand_code_8bit(i, duty_lut_width) << 8 : (i * cycle) >> (duty_width + 1);
+}
+
+// each transducer word holds 16 / (phase_width + duty_width) patterns, starting from the LSB
+// a pattern is a phase code followed by an optional duty code, both normalized to a full cycle and a half cycle respectively
+static void unpack_gain_stm(const volatile uint16_t* src, bool_t legacy) {
+  const uint32_t phase_width = _gain_stm_phase_width;
+  const uint32_t duty_width = _gain_stm_duty_width;
+  const uint32_t width = phase_width + duty_width;
+  const uint32_t phase_mask = (1 << phase_width) - 1;
+  const uint32_t duty_mask = (1 << duty_width) - 1;
+  const uint32_t phase_drop = phase_width > 8 ? phase_width - 8 : 0;
+  const uint32_t duty_drop = duty_width > 8 ? duty_width - 8 : 0;
+  uint32_t shift, w, cycle;
+  uint16_t* dst;
+  uint32_t i;
+
+  for (shift = 0; shift + width <= 16; shift += width) {
+    dst = _gain_stm_pattern;
+    if (legacy) {
+      for (i = 0; i < TRANS_NUM; i++) {
+        w = src[i] >> shift;
+        *dst = _gain_stm_phase_lut[(w & phase_mask) >> phase_drop] | _gain_stm_duty_lut[((w >> phase_width) & duty_mask) >> duty_drop];
+        dst += 2;
+      }
+    } else if (_gain_stm_lut) {
+      for (i = 0; i < TRANS_NUM; i++) {
+        w = src[i] >> shift;
+        *dst++ = _gain_stm_phase_lut[w & phase_mask];
+        *dst++ = _gain_stm_duty_lut[(w >> phase_width) & duty_mask];
+      }
+    } else {
+      for (i = 0; i < TRANS_NUM; i++) {
+        w = src[i] >> shift;
+        cycle = _cycle[i];
+        *dst++ = ((w & phase_mask) * cycle) >> phase_width;
+        *dst++ = duty_width == 0 ? cycle >> 1 : (((w >> phase_width) & duty_mask) * cycle) >> (duty_width + 1);
+      }
+    }
+    gain_stm_commit_pattern(legacy);
+  }
 }
 
 static void write_gain_stm(const volatile GlobalHeader* header, const volatile Body* body) {
-  volatile uint16_t* base = (volatile uint16_t*)FPGA_BASE;
-  uint16_t addr;
-  volatile uint16_t* dst;
+  uint16_t* dst;
   const volatile uint16_t* src;
   uint32_t freq_div;
   uint32_t cnt;
-  uint16_t phase;
+  bool_t legacy = (header->fpga_ctl_reg & LEGACY_MODE) != 0;
+  bool_t is_duty = (header->cpu_ctl_reg & IS_DUTY) != 0;
 
   if ((header->cpu_ctl_reg & STM_BEGIN) != 0) {
     _stm_cycle = 0;
-    bram_write(BRAM_SELECT_CONTROLLER, BRAM_ADDR_STM_ADDR_OFFSET, 0);
+    ctl_write(BRAM_ADDR_STM_ADDR_OFFSET, 0);
     freq_div = (body->DATA.GAIN_STM_HEAD.data[1] << 16) | body->DATA.GAIN_STM_HEAD.data[0];
-    bram_cpy(BRAM_SELECT_CONTROLLER, BRAM_ADDR_STM_FREQ_DIV_0, (uint16_t*)&freq_div, sizeof(uint32_t) >> 1);
+    ctl_cpy(BRAM_ADDR_STM_FREQ_DIV_0, (uint16_t*)&freq_div, sizeof(uint32_t) >> 1);
     _seq_gain_data_mode = body->DATA.GAIN_STM_HEAD.data[2];
+    set_gain_stm_format(header, body);
     return;
   }
 
   src = body->DATA.GAIN_STM_BODY.data;
 
-  addr = get_addr(BRAM_SELECT_STM, (_stm_cycle & GAIN_STM_BUF_SEGMENT_SIZE_MASK) << 9);
-
-  switch (_seq_gain_data_mode) {
-    case GAIN_DATA_MODE_PHASE_DUTY_FULL:
-      if ((header->fpga_ctl_reg & LEGACY_MODE) != 0) {
-        dst = &base[addr];
-        _stm_cycle += 1;
-      } else {
-        if ((header->cpu_ctl_reg & IS_DUTY) != 0) {
-          dst = &base[addr] + 1;
-          _stm_cycle += 1;
-        } else {
-          dst = &base[addr];
-        }
-      }
-      cnt = TRANS_NUM;
-      while (cnt--) {
-        *dst = *src++;
-        dst += 2;
-      }
-      break;
-    case GAIN_DATA_MODE_PHASE_FULL:
-      if ((header->fpga_ctl_reg & LEGACY_MODE) != 0) {
-        dst = &base[addr];
-        cnt = TRANS_NUM;
-        while (cnt--) {
-          *dst = 0xFF00 | ((*src++) & 0x00FF);
-          dst += 2;
+  if (get_ext_op(header) == EXT_OP_SPARSE) {
+    apply_sparse(_gain_stm_pattern, body, legacy);
+    gain_stm_commit_pattern(legacy);
+  } else if (_gain_stm_phase_width != 0) {
+    if (legacy || !is_duty) unpack_gain_stm(src, legacy);
+  } else {
+    switch (_seq_gain_data_mode) {
+      case GAIN_DATA_MODE_PHASE_FULL:
+        if (is_duty) break;
+        dst = _gain_stm_pattern;
+        for (cnt = 0; cnt < TRANS_NUM; cnt++) {
+          *dst++ = *src++;
+          *dst++ = _cycle[cnt] >> 1;
         }
-        _stm_cycle += 1;
-        src = body->DATA.GAIN_STM_BODY.data;
-        addr = get_addr(BRAM_SELECT_STM, (_stm_cycle & GAIN_STM_BUF_SEGMENT_SIZE_MASK) << 9);
-        dst = &base[addr];
+        gain_stm_commit_pattern(legacy);
+        break;
+      case GAIN_DATA_MODE_PHASE_COMPACT:
+      case GAIN_DATA_MODE_PACKED:
+        _err |= ERR_INVALID_DATA_MODE;
+        break;
+      default:
+        dst = _gain_stm_pattern + (!legacy && is_duty ? 1 : 0);
         cnt = TRANS_NUM;
         while (cnt--) {
-          *dst = 0xFF00 | (((*src++) >> 8) & 0x00FF);
+          *dst = *src++;
           dst += 2;
         }
-        _stm_cycle += 1;
-      } else {
-        if ((header->cpu_ctl_reg & IS_DUTY) != 0) break;
-        dst = &base[addr];
-        cnt = 0;
-        while (cnt++ < TRANS_NUM) {
-          *dst++ = *src++;
-          *dst++ = _cycle[cnt] >> 1;
-        }
-        _stm_cycle += 1;
-      }
-      break;
-    case GAIN_DATA_MODE_PHASE_HALF:
-      if ((header->fpga_ctl_reg & LEGACY_MODE) == 0) break;
-      dst = &base[addr];
-      cnt = TRANS_NUM;
-      while (cnt--) {
-        phase = (*src++) & 0x000F;
-        *dst = 0xFF00 | (phase << 4) | phase;
-        dst += 2;
-      }
-      _stm_cycle += 1;
-
-      src = body->DATA.GAIN_STM_BODY.data;
-      addr = get_addr(BRAM_SELECT_STM, (_stm_cycle & GAIN_STM_BUF_SEGMENT_SIZE_MASK) << 9);
-      dst = &base[addr];
-      cnt = TRANS_NUM;
-      while (cnt--) {
-        phase = ((*src++) >> 4) & 0x000F;
-        *dst = 0xFF00 | (phase << 4) | phase;
-        dst += 2;
-      }
-      _stm_cycle += 1;
-
-      src = body->DATA.GAIN_STM_BODY.data;
-      addr = get_addr(BRAM_SELECT_STM, (_stm_cycle & GAIN_STM_BUF_SEGMENT_SIZE_MASK) << 9);
-      dst = &base[addr];
-      cnt = TRANS_NUM;
-      while (cnt--) {
-        phase = ((*src++) >> 8) & 0x000F;
-        *dst = 0xFF00 | (phase << 4) | phase;
-        dst += 2;
-      }
-      _stm_cycle += 1;
-
-      src = body->DATA.GAIN_STM_BODY.data;
-      addr = get_addr(BRAM_SELECT_STM, (_stm_cycle & GAIN_STM_BUF_SEGMENT_SIZE_MASK) << 9);
-      dst = &base[addr];
-      cnt = TRANS_NUM;
-      while (cnt--) {
-        phase = ((*src++) >> 12) & 0x000F;
-        *dst = 0xFF00 | (phase << 4) | phase;
-        dst += 2;
-      }
-      _stm_cycle += 1;
-      break;
-    default:
-      if ((header->fpga_ctl_reg & LEGACY_MODE) != 0) {
-        dst = &base[addr];
-        _stm_cycle += 1;
-      } else {
-        if ((header->cpu_ctl_reg & IS_DUTY) != 0) {
-          dst = &base[addr] + 1;
-          _stm_cycle += 1;
-        } else {
-          dst = &base[addr];
-        }
-      }
-      cnt = TRANS_NUM;
-      while (cnt--) {
-        *dst = *src++;
-        dst += 2;
-      }
-      break;
+        if (legacy || is_duty) gain_stm_commit_pattern(legacy);
+        break;
+    }
   }
 
-  if ((_stm_cycle & GAIN_STM_BUF_SEGMENT_SIZE_MASK) == 0)
-    bram_write(BRAM_SELECT_CONTROLLER, BRAM_ADDR_STM_ADDR_OFFSET, (_stm_cycle & ~GAIN_STM_BUF_SEGMENT_SIZE_MASK) >> GAIN_STM_BUF_SEGMENT_SIZE_WIDTH);
+  if ((header->cpu_ctl_reg & STM_END) != 0) ctl_write(BRAM_ADDR_STM_CYCLE, max(1, _stm_cycle) - 1);
+}
+
+static void write_focus(const volatile GlobalHeader* header) {
+  bool_t legacy = (header->fpga_ctl_reg & LEGACY_MODE) != 0;
+
+  if ((header->fpga_ctl_reg & OP_MODE) == 0) {
+    calc_focus(header, _normal_buf, legacy);
+    normal_cpy(_normal_buf, legacy);
+    return;
+  }
+
+  if ((header->fpga_ctl_reg & STM_GAIN_MODE) == 0) return;
 
-  if ((header->cpu_ctl_reg & STM_END) != 0) bram_write(BRAM_SELECT_CONTROLLER, BRAM_ADDR_STM_CYCLE, max(1, _stm_cycle) - 1);
+  calc_focus(header, _gain_stm_pattern, legacy);
+  gain_stm_commit_pattern(legacy);
+
+  if ((header->cpu_ctl_reg & STM_END) != 0) ctl_write(BRAM_ADDR_STM_CYCLE, max(1, _stm_cycle) - 1);
+}
+
+static void init_pending(void) {
+  uint32_t i;
+  for (i = 0; i < PENDING_SIZE; i++) {
+    _pending_order[i] = i;
+    _pending_used[i] = false;
+  }
+  _pending_num = 0;
 }
 
+// the part of MSG_CLEAR done in recv_ethercat: reset what only recv_ethercat uses, and leave the rest to drain()
+static void request_clear(void) {
+  _read_fpga_info = false;
+  _err = 0;
+
+  _mod_uploading = false;
+  _stm_uploading = false;
+
+  _seq_window = false;
+  _seq_expected = MSG_BEGIN;
+  memset_volatile(_reorder_seq, 0x00, sizeof(_reorder_seq));
+  _sTx.recv_msg_id = 0;
+  _sTx.applied_msg_id = 0;
+  _last_accepted_id = 0;
+
+  _clear_push_cnt = _push_cnt;
+  _clear_prio_cursor = _prio_write_cursor;
+  _last_record_sealed = true;
+  _clear_req_cnt++;
+}
+
+// the part of MSG_CLEAR done in drain(): reset the device, and drop the frames received before MSG_CLEAR
+// if another MSG_CLEAR arrives meanwhile, the counts read here differ from _clear_req_cnt at the end, and drain() calls this again
 static void clear(void) {
   uint32_t freq_div_4k = 40960;
+  uint32_t req = _clear_req_cnt;
+  uint32_t push_cnt = _clear_push_cnt;
+  uint32_t prio_cursor = _clear_prio_cursor;
 
-  _read_fpga_info = false;
-  bram_write(BRAM_SELECT_CONTROLLER, BRAM_ADDR_CTL_REG, LEGACY_MODE);
+  ctl_invalidate();
 
-  bram_write(BRAM_SELECT_CONTROLLER, BRAM_ADDR_SILENT_STEP, 10);
-  bram_write(BRAM_SELECT_CONTROLLER, BRAM_ADDR_SILENT_CYCLE, 4096);
+  ctl_write(BRAM_ADDR_CTL_REG, LEGACY_MODE);
+
+  ctl_write(BRAM_ADDR_SILENT_STEP, 10);
+  ctl_write(BRAM_ADDR_SILENT_CYCLE, 4096);
 
   _stm_cycle = 0;
 
+  _sync0_div = 1;
+  _sync0_cnt = 0;
+  init_pending();
+
+  _pose_enabled = false;
+  _phase_offset_enabled = false;
+  memset_volatile(_phase_offset_upload, 0x00, sizeof(_phase_offset_upload));
+  memset_volatile(_phase_offset, 0x00, sizeof(_phase_offset));
+  memset_volatile(_phase_offset_legacy, 0x00, sizeof(_phase_offset_legacy));
+  memset_volatile(_gain_stm_pattern, 0x00, sizeof(_gain_stm_pattern));
+
   _mod_cycle = 2;
-  bram_write(BRAM_SELECT_CONTROLLER, BRAM_ADDR_MOD_CYCLE, max(1, _mod_cycle) - 1);
-  bram_cpy(BRAM_SELECT_CONTROLLER, BRAM_ADDR_MOD_FREQ_DIV_0, (uint16_t*)&freq_div_4k, sizeof(uint32_t) >> 1);
+  ctl_write(BRAM_ADDR_MOD_CYCLE, max(1, _mod_cycle) - 1);
+  ctl_cpy(BRAM_ADDR_MOD_FREQ_DIV_0, (uint16_t*)&freq_div_4k, sizeof(uint32_t) >> 1);
   bram_write(BRAM_SELECT_MOD, 0, 0x0000);
 
   bram_set(BRAM_SELECT_NORMAL, 0, 0x0000, TRANS_NUM << 1);
+  memset_volatile(_normal_shadow, 0x00, sizeof(_normal_shadow));
 
-  memset_volatile(&_head_buf[0], 0x00, sizeof(GlobalHeader) * BUF_SIZE);
-  memset_volatile(&_body_buf[0], 0x00, sizeof(Body) * BUF_SIZE);
+  // recv_ethercat may have queued frames after MSG_CLEAR, so only the records before it are dropped
+  while (is_before(_pop_cnt, push_cnt) && pop(&_head, &_body, &_inflight)) {
+  }
+  _inflight_valid = false;
+  _prio_read_cursor = prio_cursor;
+  _ctl_reg_barrier = push_cnt;
+  _silencer_barrier = push_cnt;
+  _phase_barrier = push_cnt;
+  _duty_barrier = push_cnt;
   memset_volatile(&_head, 0x00, sizeof(GlobalHeader));
   memset_volatile(&_body, 0x00, sizeof(Body));
+
+  _clear_done_cnt = req;
 }
 
 inline static uint16_t get_cpu_version(void) { return CPU_VERSION; }
 inline static uint16_t get_fpga_version(void) { return bram_read(BRAM_SELECT_CONTROLLER, BRAM_ADDR_VERSION_NUM); }
 inline static uint16_t read_fpga_info(void) { return bram_read(BRAM_SELECT_CONTROLLER, BRAM_ADDR_FPGA_INFO); }
 
-void init_app(void) { clear(); }
+void init_app(void) {
+  init_trans_pos();
+  request_clear();
+  clear();
+}
 
-void process() {
-  uint16_t ctl_reg;
-  if (pop(&_head, &_body)) {
-    ctl_reg = _head.fpga_ctl_reg;
-    bram_write(BRAM_SELECT_CONTROLLER, BRAM_ADDR_CTL_REG, ctl_reg);
+// configuration registers a batch may write; the others are owned by the CPU (cycles, offsets, CTL_REG) or read-only
+static bool_t is_batch_ctl_reg(uint16_t addr) {
+  switch (addr) {
+    case BRAM_ADDR_SILENT_CYCLE:
+    case BRAM_ADDR_SILENT_STEP:
+    case BRAM_ADDR_MOD_FREQ_DIV_0:
+    case BRAM_ADDR_MOD_FREQ_DIV_1:
+    case BRAM_ADDR_STM_FREQ_DIV_0:
+    case BRAM_ADDR_STM_FREQ_DIV_1:
+    case BRAM_ADDR_SOUND_SPEED_0:
+    case BRAM_ADDR_SOUND_SPEED_1:
+      return true;
+    default:
+      return false;
+  }
+}
 
-    if ((_head.cpu_ctl_reg & MOD) != 0)
-      write_mod(&_head);
-    else if ((_head.cpu_ctl_reg & CONFIG_SILENCER) != 0) {
-      config_silencer(&_head);
-    };
+// writes superseded by an urgent frame (see get_superseded) are skipped, like those of a whole frame
+static bool_t run_batch_record(uint8_t type, const volatile uint16_t* p, uint32_t len, bool_t legacy, uint8_t superseded) {
+  uint32_t addr, i;
+  uint32_t freq_div;
 
-    if ((_head.cpu_ctl_reg & WRITE_BODY) == 0) return;
+  switch (type) {
+    case BATCH_SILENCER:
+      if (len != 2) return false;
+      if ((superseded & SUPERSEDED_SILENCER) != 0) return true;
+      ctl_write(BRAM_ADDR_SILENT_STEP, p[0]);
+      ctl_write(BRAM_ADDR_SILENT_CYCLE, p[1]);
+      return true;
+    case BATCH_MOD_DELAY:
+      if (len < 1 || p[0] + len - 1 > TRANS_NUM) return false;
+      bram_cpy_volatile(BRAM_SELECT_CONTROLLER, BRAM_ADDR_MOD_DELAY_BASE + p[0], p + 1, len - 1);
+      return true;
+    case BATCH_CTL_REG:
+      if ((len & 1) != 0) return false;
+      for (i = 0; i < len; i += 2)
+        if (!is_batch_ctl_reg(p[i])) return false;
+      for (i = 0; i < len; i += 2) {
+        if ((superseded & SUPERSEDED_SILENCER) != 0 && (p[i] == BRAM_ADDR_SILENT_CYCLE || p[i] == BRAM_ADDR_SILENT_STEP)) continue;
+        ctl_write(p[i], p[i + 1]);
+      }
+      return true;
+    case BATCH_MOD:
+      if (len < 4 || ((uint32_t)p[3] + 1) >> 1 > len - 4) return false;
+      if ((p[3] & 1) != 0 && (p[0] & BATCH_MOD_END) == 0) return false;  // samples are packed two to a word, so only the last record may end halfway
+      if ((p[0] & BATCH_MOD_BEGIN) != 0) {
+        freq_div = ((uint32_t)p[2] << 16) | p[1];
+        begin_mod(freq_div);
+      }
+      append_mod((const uint16_t*)(p + 4), p[3]);
+      if ((p[0] & BATCH_MOD_END) != 0) end_mod();
+      return true;
+    case BATCH_NORMAL:
+      if (len < 1 || p[0] + len - 1 > (TRANS_NUM << 1)) return false;
+      addr = p[0];
+      for (i = 1; i < len; i++, addr++) {
+        if ((superseded & get_normal_addr_lane(addr, legacy)) != 0) continue;
+        normal_write(addr, (addr & 1) == 0 ? calibrate_phase(addr >> 1, p[i], legacy) : p[i]);
+      }
+      return true;
+    default:
+      return true;  // unknown records are skipped
+  }
+}
 
-    if ((_head.cpu_ctl_reg & MOD_DELAY) != 0) {
-      set_mod_delay(&_body);
+// records are executed in order until BATCH_END or the end of body
+static void run_batch(const volatile GlobalHeader* header, const volatile Body* body, uint8_t superseded) {
+  const volatile uint16_t* p = body->DATA.BATCH.data;
+  const volatile uint16_t* end = p + TRANS_NUM;
+  bool_t legacy = (header->fpga_ctl_reg & LEGACY_MODE) != 0;
+  uint8_t type;
+  uint32_t len;
+
+  while (p < end) {
+    type = *p & 0xFF;
+    len = *p >> 8;
+    p++;
+    if (type == BATCH_END) return;
+    if (len > (uint32_t)(end - p) || !run_batch_record(type, p, len, legacy, superseded)) {
+      _err |= ERR_INVALID_BATCH;
       return;
     }
+    p += len;
+  }
+}
+
+static void apply_frame(const volatile GlobalHeader* header, const volatile Body* body, uint8_t superseded) {
+  uint16_t ctl_reg;
 
-    if ((ctl_reg & OP_MODE) == 0) {
-      write_normal_op(&_head, &_body);
+  if (is_sync(header)) {
+    synchronize(header, body);
+    return;
+  }
+
+  ctl_reg = header->fpga_ctl_reg;
+  if ((superseded & SUPERSEDED_CTL_REG) == 0) ctl_write(BRAM_ADDR_CTL_REG, ctl_reg);
+
+  if ((header->cpu_ctl_reg & MOD) != 0)
+    write_mod(header);
+  else if ((header->cpu_ctl_reg & CONFIG_SILENCER) != 0 && (superseded & SUPERSEDED_SILENCER) == 0) {
+    config_silencer(header);
+  };
+
+  switch (get_ext_op(header)) {
+    case EXT_OP_POSE:
+      set_pose(header);
+      break;
+    case EXT_OP_FOCUS:
+      if ((superseded & get_normal_lanes(header)) == 0) write_focus(header);
+      return;
+    case EXT_OP_PHASE_OFFSET:
+      if ((header->cpu_ctl_reg & WRITE_BODY) != 0) set_phase_offset(body);
       return;
+    case EXT_OP_UNIFORM_PHASE:
+    case EXT_OP_UNIFORM_DUTY:
+    case EXT_OP_STOP:
+      if ((superseded & get_normal_lanes(header)) == 0) write_uniform(header);
+      return;
+    case EXT_OP_BATCH:
+      if ((header->cpu_ctl_reg & WRITE_BODY) != 0) run_batch(header, body, superseded);
+      return;
+    default:
+      break;
+  }
+
+  if ((header->cpu_ctl_reg & WRITE_BODY) == 0) return;
+
+  if ((header->cpu_ctl_reg & MOD_DELAY) != 0) {
+    set_mod_delay(body);
+    return;
+  }
+
+  if ((ctl_reg & OP_MODE) == 0) {
+    write_normal_op(header, body, superseded);
+    return;
+  }
+
+  if ((ctl_reg & STM_GAIN_MODE) == 0)
+    write_point_stm(header, body);
+  else
+    write_gain_stm(header, body);
+}
+
+static void stamp_commit(uint8_t msg_id) {
+  _sTx.recv_time = _recv_time[msg_id];
+  _sTx.commit_time = (uint32_t)get_dc_sys_time();
+  _sTx.stamp_msg_id = msg_id;
+}
+
+static void commit_frame(const volatile GlobalHeader* header, const volatile Body* body, uint8_t superseded) {
+  uint8_t msg_id = header->msg_id;
+  apply_frame(header, body, superseded);
+  stamp_commit(msg_id);
+}
+
+// a Normal mode frame without extended operation rewrites the whole lane selected by IS_DUTY (or the whole word in legacy mode)
+static bool_t is_full_normal_op(const volatile GlobalHeader* header) {
+  if ((header->cpu_ctl_reg & (MOD | CONFIG_SILENCER | CONFIG_SYNC | WRITE_BODY | MOD_DELAY)) != WRITE_BODY) return false;
+  if ((header->fpga_ctl_reg & OP_MODE) != 0) return false;
+  return get_ext_op(header) == EXT_OP_NONE && get_activation_time(header) == 0;
+}
+
+// overwrite the last queued frame if the new one supersedes it, so that a backlog of Normal mode frames collapses into the latest one
+static bool_t coalesce_tail(const volatile GlobalHeader* head, const volatile Body* body) {
+  uint32_t tail;
+
+  if (is_queue_empty()) return false;
+  if (!is_full_normal_op(head)) return false;
+
+  if (get_queue_depth() <= 1 && _processing) return false;  // may be being popped
+  if (_last_record_sealed) return false;
+  tail = _last_record;
+  if (!is_full_normal_op(ring_header(tail))) return false;
+  if (ring_header(tail)->cpu_ctl_reg != head->cpu_ctl_reg || ring_header(tail)->fpga_ctl_reg != head->fpga_ctl_reg) return false;
+
+  memcpy_volatile(ring_header(tail), head, sizeof(GlobalHeader));
+  memcpy_volatile(ring_body(tail), body, sizeof(Body));
+  return true;
+}
+
+static void track_upload(const volatile GlobalHeader* header) {
+  uint8_t flag = header->cpu_ctl_reg;
+  if ((flag & MOD) != 0) {
+    if ((flag & MOD_BEGIN) != 0) _mod_uploading = true;
+    if ((flag & MOD_END) != 0) _mod_uploading = false;
+  }
+  if ((header->fpga_ctl_reg & OP_MODE) != 0) {
+    if ((flag & STM_BEGIN) != 0) _stm_uploading = true;
+    if ((flag & STM_END) != 0) _stm_uploading = false;
+  }
+}
+
+// a plain Normal mode frame (see is_full_normal_op) can be applied in recv_ethercat, without waiting for the next poll(),
+// if nothing queued before it is still pending; silencer, extended operation and STM frames always go through the queue
+// frames are never applied here when they are paced by sync0(), so that they take effect on the SYNC0 cadence
+static bool_t can_apply_immediately(const volatile GlobalHeader* header) {
+  if (_drain_sync0 || _sync0_div > 1 || is_clear_pending()) return false;
+  if (!is_full_normal_op(header)) return false;
+  if (_mod_uploading || _stm_uploading) return false;
+  return !_processing && is_queue_empty() && is_prio_empty();
+}
+
+// frames with the same activation time are kept in arrival order
+static void push_pending(const volatile GlobalHeader* header, const volatile Body* body, const volatile Track* track, uint32_t index, uint64_t time) {
+  uint32_t slot = _pending_order[_pending_num];
+  uint32_t pos = _pending_num;
+
+  memcpy_volatile(&_pending_head[slot], header, sizeof(GlobalHeader));
+  if (has_body(header)) memcpy_volatile(&_pending_body[slot], body, sizeof(Body));
+  _pending_time[slot] = time;
+  _pending_track[slot] = *track;
+  _pending_index[slot] = index;
+  _pending_used[slot] = true;
+
+  while (pos > 0 && _pending_time[_pending_order[pos - 1]] > time) {
+    _pending_order[pos] = _pending_order[pos - 1];
+    pos--;
+  }
+  _pending_order[pos] = slot;
+  _pending_num++;
+}
+
+static uint8_t get_superseded(uint32_t index) {
+  uint8_t superseded = 0;
+  if (is_before(index, _ctl_reg_barrier)) superseded |= SUPERSEDED_CTL_REG;
+  if (is_before(index, _silencer_barrier)) superseded |= SUPERSEDED_SILENCER;
+  if (is_before(index, _phase_barrier)) superseded |= SUPERSEDED_PHASE;
+  if (is_before(index, _duty_barrier)) superseded |= SUPERSEDED_DUTY;
+  return superseded;
+}
+
+static void apply_due_frames(void) {
+  uint32_t slot, i;
+  while (_pending_num > 0) {
+    slot = _pending_order[0];
+    if (get_dc_sys_time() < _pending_time[slot]) return;
+
+    _processing = true;
+    commit_frame(&_pending_head[slot], &_pending_body[slot], get_superseded(_pending_index[slot]));
+    _processing = false;
+
+    for (i = 1; i < _pending_num; i++) _pending_order[i - 1] = _pending_order[i];
+    _pending_order[--_pending_num] = slot;
+    _pending_used[slot] = false;
+  }
+}
+
+// only header-only frames marked with EXT_FLAG_URGENT overtake the queue; any other frame keeps FIFO order
+static bool_t is_urgent(const volatile GlobalHeader* header) {
+  if ((get_ext_flags(header) & EXT_FLAG_URGENT) == 0) return false;
+  if ((header->cpu_ctl_reg & (MOD | CONFIG_SYNC | WRITE_BODY)) != 0) return false;
+  if (get_activation_time(header) != 0) return false;
+  switch (get_ext_op(header)) {
+    case EXT_OP_NONE:
+    case EXT_OP_UNIFORM_PHASE:
+    case EXT_OP_UNIFORM_DUTY:
+    case EXT_OP_STOP:
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool_t push_prio(const volatile GlobalHeader* head, const Track* track) {
+  uint32_t next = _prio_write_cursor + 1;
+  if (next >= PRIO_BUF_SIZE) next = 0;
+  if (next == _prio_read_cursor) return false;
+
+  memcpy_volatile(&_prio_buf[_prio_write_cursor], head, sizeof(GlobalHeader));
+  _prio_barrier[_prio_write_cursor] = _push_cnt;
+  _prio_track[_prio_write_cursor] = *track;
+  _last_record_sealed = true;
+
+  _prio_write_cursor = next;
+  return true;
+}
+
+// an urgent frame overrides the control register, and the silencer or Normal BRAM if it writes them,
+// for the frames queued before it; their Modulation and STM data are still written
+bool_t pop_prio(volatile GlobalHeader* head, volatile Track* track) {
+  uint32_t barrier;
+  uint8_t lanes;
+  uint32_t next;
+
+  if (is_prio_empty()) return false;
+
+  memcpy_volatile(head, &_prio_buf[_prio_read_cursor], sizeof(GlobalHeader));
+  barrier = _prio_barrier[_prio_read_cursor];
+  *track = _prio_track[_prio_read_cursor];
+  _inflight_valid = true;
+
+  _ctl_reg_barrier = barrier;
+  if ((head->cpu_ctl_reg & CONFIG_SILENCER) != 0) _silencer_barrier = barrier;
+  lanes = get_normal_lanes(head);
+  if ((lanes & SUPERSEDED_PHASE) != 0) _phase_barrier = barrier;
+  if ((lanes & SUPERSEDED_DUTY) != 0) _duty_barrier = barrier;
+
+  next = _prio_read_cursor + 1;
+  if (next >= PRIO_BUF_SIZE) next = 0;
+  _prio_read_cursor = next;
+  return true;
+}
+
+static bool_t process_prio(void) {
+  _processing = true;
+  if (!pop_prio(&_head, &_inflight)) {
+    _processing = false;
+    return false;
+  }
+  commit_frame(&_head, &_body, 0);
+  _inflight_valid = false;
+  _processing = false;
+  return true;
+}
+
+bool_t process() {
+  uint64_t time;
+  uint32_t index;
+
+  // a timed frame at the front of the queue waits there until a pending slot is free, unless it is already due
+  if (is_prio_empty() && _pending_num == PENDING_SIZE && !is_queue_empty()) {
+    time = get_activation_time(peek());
+    if (time != 0 && get_dc_sys_time() < time) {
+      _err |= ERR_PENDING_FULL;
+      return false;
     }
+  }
 
-    if ((ctl_reg & STM_GAIN_MODE) == 0)
-      write_point_stm(&_head, &_body);
-    else
-      write_gain_stm(&_head, &_body);
+  if (process_prio()) return true;
+
+  _processing = true;
+  index = _pop_cnt;
+  if (!pop(&_head, &_body, &_inflight)) {
+    _processing = false;
+    return false;
+  }
+  time = get_activation_time(&_head);
+  if (time != 0 && get_dc_sys_time() < time)
+    push_pending(&_head, &_body, &_inflight, index, time);
+  else
+    commit_frame(&_head, &_body, get_superseded(index));
+  _inflight_valid = false;
+  _processing = false;
+  return true;
+}
+
+static void update_status(void) {
+  uint16_t telemetry = 0;
+
+  switch (_telemetry_id) {
+    case TELEMETRY_CPU_VERSION:
+      telemetry = get_cpu_version();
+      break;
+    case TELEMETRY_FPGA_VERSION:
+      telemetry = get_fpga_version();
+      break;
+    case TELEMETRY_FPGA_INFO:
+      telemetry = read_fpga_info();
+      break;
+    case TELEMETRY_SYNC0_DIV:
+      telemetry = _sync0_div;
+      break;
+    default:
+      break;
   }
+  _sTx.telemetry = telemetry;
+  _sTx.telemetry_id = _telemetry_id;
+  _telemetry_id = _telemetry_id + 1 >= TELEMETRY_NUM ? 0 : _telemetry_id + 1;
+
+  _sTx.queue_depth = get_queue_depth();
+  _sTx.pending_num = _pending_num;
+  _sTx.err = _err;
+  _sTx.stm_cycle = _stm_cycle;
+  _sTx.mod_cycle = _mod_cycle;
+}
+
+// a context that preempted another one in the middle of drain() leaves the queue to it
+static void drain(void) {
+  if (_draining) return;
+  _draining = true;
+  do {
+    if (is_clear_pending()) clear();
+    apply_due_frames();
+  } while (process());
+  _draining = false;
+}
+
+// urgent frames are applied on every sync0() and update(), even when the SYNC0 divider or poll() holds back the queue
+static void drain_prio(void) {
+  if (_draining) return;
+  _draining = true;
+  if (is_clear_pending()) clear();
+  while (process_prio()) continue;
+  _draining = false;
 }
 
 void update(void) {
-  process();
+  if (!_drain_external)
+    drain();
+  else
+    drain_prio();
+  update_status();
 
   switch (_msg_id) {
     case MSG_RD_CPU_VERSION:
@@ -553,10 +1699,170 @@ void update(void) {
   _sTx.ack = _ack;
 }
 
+void poll(void) {
+  _drain_external = true;
+  drain();
+}
+
+void sync0(void) {
+  _drain_external = true;
+  _drain_sync0 = true;
+  if (++_sync0_cnt < _sync0_div) {
+    drain_prio();
+    return;
+  }
+  _sync0_cnt = 0;
+  drain();
+}
+
+// a sync frame is queued like any other, so that synchronize() never runs while poll(), sync0() or update() is applying a frame
+static bool_t route_frame(const volatile GlobalHeader* header, const volatile Body* body, const Track* track) {
+  if (can_apply_immediately(header)) {
+    commit_frame(header, body, 0);
+    return true;
+  }
+  if (is_urgent(header)) {
+    if (push_prio(header, track)) return true;
+    _err |= ERR_PRIO_FULL;
+    return false;
+  }
+  if (coalesce_tail(header, body)) return true;  // the record keeps the Track of the first frame coalesced into it
+
+  if (!push(header, body, track)) {
+    _err |= ERR_QUEUE_FULL;
+    return false;
+  }
+  track_upload(header);
+  return true;
+}
+
+// returns false if the frame was not taken because the queue is full; the caller must not acknowledge it
+static bool_t accept_frame(const volatile GlobalHeader* header, const volatile Body* body) {
+  Track track;
+
+  if (is_timed_stm(header)) _err |= ERR_INVALID_TIMED;
+
+  track.index = _accept_cnt;
+  track.prev_msg_id = _last_accepted_id;
+  if (!route_frame(header, body, &track)) return false;
+
+  _accept_cnt++;
+  _last_accepted_id = header->msg_id;
+  return true;
+}
+
+inline static uint8_t seq_next(uint8_t seq) { return seq >= MSG_END ? MSG_BEGIN : seq + 1; }
+inline static uint8_t seq_prev(uint8_t seq) { return seq <= MSG_BEGIN ? MSG_END : seq - 1; }
+inline static uint32_t seq_dist(uint8_t from, uint8_t to) { return ((uint32_t)to + SEQ_NUM - from) % SEQ_NUM; }
+
+// never full: every stashed frame is less than SEQ_WINDOW ahead of _seq_expected, and is taken out when the sequence reaches it
+static void stash_frame(const volatile GlobalHeader* header, const volatile Body* body) {
+  uint32_t i;
+  for (i = 0; i < SEQ_WINDOW; i++)
+    if (_reorder_seq[i] == header->msg_id) return;
+  for (i = 0; i < SEQ_WINDOW; i++) {
+    if (_reorder_seq[i] != 0) continue;
+    _recv_time[header->msg_id] = (uint32_t)get_dc_sys_time();
+    memcpy_volatile(&_reorder_head[i], header, sizeof(GlobalHeader));
+    memcpy_volatile(&_reorder_body[i], body, sizeof(Body));  // body is needed even without WRITE_BODY, e.g. by CONFIG_SYNC
+    _reorder_seq[i] = header->msg_id;
+    return;
+  }
+}
+
+static bool_t unstash_frame(uint8_t seq) {
+  uint32_t i;
+  for (i = 0; i < SEQ_WINDOW; i++) {
+    if (_reorder_seq[i] != seq) continue;
+    if (!accept_frame(&_reorder_head[i], &_reorder_body[i])) return false;
+    _reorder_seq[i] = 0;
+    return true;
+  }
+  return false;
+}
+
+static void drain_stash(void) {
+  while (unstash_frame(_seq_expected)) _seq_expected = seq_next(_seq_expected);
+}
+
+static bool_t accept_seq(const volatile GlobalHeader* header, const volatile Body* body) {
+  _recv_time[header->msg_id] = (uint32_t)get_dc_sys_time();
+  if (!accept_frame(header, body)) return false;
+  _seq_expected = seq_next(header->msg_id);
+  drain_stash();
+  return true;
+}
+
+// msg_id from MSG_BEGIN to MSG_END is a wrapping sequence number;
+// frames up to SEQ_WINDOW-1 ahead are held until the gap is filled, and older ones are retransmissions
+// a frame further ahead is ignored, so that the host goes back to the one after the ack
+// returns false if the frame has to be sent again, because the queue is full or it is beyond the window
+static bool_t recv_seq(const volatile GlobalHeader* header, const volatile Body* body) {
+  uint8_t seq = header->msg_id;
+  uint32_t d;
+
+  drain_stash();
+
+  d = seq_dist(_seq_expected, seq);
+  if (d == 0) return accept_seq(header, body);
+  if (d >= SEQ_NUM - SEQ_WINDOW) return true;
+  if (d < SEQ_WINDOW) {
+    stash_frame(header, body);
+    return true;
+  }
+
+  _err |= ERR_OUT_OF_WINDOW;
+  return false;
+}
+
+// without EXT_FLAG_SEQ_WINDOW, every msg_id different from the previous one is a new frame
+static bool_t recv_plain(const volatile GlobalHeader* header, const volatile Body* body) {
+  _recv_time[header->msg_id] = (uint32_t)get_dc_sys_time();
+  if (!accept_frame(header, body)) return false;
+  _seq_expected = seq_next(header->msg_id);
+  if ((get_ext_flags(header) & EXT_FLAG_SEQ_WINDOW) != 0) _seq_window = true;
+  return true;
+}
+
+inline static const volatile Track* older(const volatile Track* a, const volatile Track* b) {
+  return (a == 0 || is_before(b->index, a->index)) ? b : a;
+}
+
+// every frame accepted before the oldest one still queued, pending or being applied has been applied
+// called only from recv_ethercat, which poll() and sync0() cannot interrupt, so the reported msg_id never goes backward
+static void publish_applied(void) {
+  const volatile Track* oldest = 0;
+  uint32_t i;
+
+  if (is_clear_pending()) return;  // nothing received after MSG_CLEAR is applied before drain() has finished clearing
+
+  if (_inflight_valid) oldest = &_inflight;
+  if (!is_queue_empty()) oldest = older(oldest, ring_track(front_record()));
+  if (!is_prio_empty()) oldest = older(oldest, &_prio_track[_prio_read_cursor]);
+  for (i = 0; i < PENDING_SIZE; i++)
+    if (_pending_used[i]) oldest = older(oldest, &_pending_track[i]);
+
+  _sTx.applied_msg_id = oldest == 0 ? _last_accepted_id : oldest->prev_msg_id;
+}
+
+inline static void ack_seq(void) {
+  _ack = (_ack & 0x00FF) | (((uint16_t)seq_prev(_seq_expected)) << 8);
+  _sTx.recv_msg_id = seq_prev(_seq_expected);
+}
+
 void recv_ethercat(void) {
   GlobalHeader* header = (GlobalHeader*)(_sRx1.data);
   Body* body = (Body*)(_sRx0.data);
-  if (header->msg_id == _msg_id) return;
+  if (header->msg_id == _msg_id) {
+    // retransmission; retry stashed frames that did not fit in the queue before
+    if (_seq_window && _msg_id >= MSG_BEGIN && _msg_id <= MSG_END) {
+      drain_stash();
+      ack_seq();
+      _sTx.ack = _ack;
+    }
+    publish_applied();
+    return;
+  }
   _msg_id = header->msg_id;
   _ack = ((uint16_t)(header->msg_id)) << 8;
   _read_fpga_info = (header->fpga_ctl_reg & READS_FPGA_INFO) != 0;
@@ -564,7 +1870,7 @@ void recv_ethercat(void) {
 
   switch (_msg_id) {
     case MSG_CLEAR:
-      clear();
+      request_clear();
       break;
     case MSG_RD_CPU_VERSION:
       _ack = (_ack & 0xFF00) | (get_cpu_version() & 0xFF);
@@ -576,17 +1882,15 @@ void recv_ethercat(void) {
       _ack = (_ack & 0xFF00) | ((get_fpga_version() >> 8) & 0xFF);
       break;
     default:
-      if (_msg_id > MSG_END) break;
-
-      if (((header->cpu_ctl_reg & MOD) == 0) && ((header->cpu_ctl_reg & CONFIG_SYNC) != 0)) {
-        synchronize(header, body);
+      if (_msg_id > MSG_END) {
+        _err |= ERR_INVALID_MSG_ID;
         break;
       }
 
-      while (!push(header, body)) {
-      }
-
+      if (!(_seq_window ? recv_seq(header, body) : recv_plain(header, body))) _msg_id = MSG_RETRY;
+      ack_seq();
       break;
   }
   _sTx.ack = _ack;
+  publish_applied();
 }